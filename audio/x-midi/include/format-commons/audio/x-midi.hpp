@@ -18,12 +18,24 @@
 #define FORMAT_COMMONS_AUDIO_X_MIDI_HPP
 
 #include <format.hpp>
+#include <format-commons/audio/x-midi/messages.hpp>
+#include <format-commons/audio/x-midi/scan.hpp>
+#include <format-commons/audio/x-midi/decoder.hpp>
+#include <format-commons/audio/x-midi/event.hpp>
+#include <format-commons/audio/x-midi/parser.hpp>
+#include <format-commons/audio/x-midi/ring_buffer.hpp>
+#include <format-commons/audio/x-midi/smf.hpp>
+#include <format-commons/audio/x-midi/merge.hpp>
+#include <format-commons/audio/x-midi/visitor.hpp>
+#include <format-commons/audio/x-midi/filter.hpp>
+#include <format-commons/audio/x-midi/demux.hpp>
+#include <format-commons/audio/x-midi/spans.hpp>
+
+#include <cstring>
+#include <deque>
 
 namespace format::audio::x_midi {
 
-    struct empty_sysex_message : public std::exception {
-    };
-
     template<int V> using IntegralConstant = Constant<std::integral_constant<uint8_t, V>>;
 
     template<typename T, int S, int E>
@@ -35,183 +47,6 @@ namespace format::audio::x_midi {
         STATUS_BYTE
     };
 
-    enum message_type_t {
-        NOTEOFF = 0b1000,
-        NOTEON,
-        POLYPHONICKEYPRESSURE,
-        CONTROLCHANGE,
-        PROGRAMCHANGE,
-        CHANNELPRESSURE,
-        PITCHWHEELCHANGE,
-        SYSTEMMESSAGE
-    };
-
-    enum system_common_message {
-        SYSEX_MESSAGE = 0b0000,
-        UNDEFINED_1,
-        SONG_POSITION_POINTER,
-        SONG_SELECT,
-        UNDEFINED_4,
-        UNDEFINED_5,
-        TUNE_REQUEST,
-        END_OF_EXCLUSIVE,
-        TIMING_CLOCK,
-        UNDEFINED_52,
-        START,
-        CONTINUE,
-        STOP,
-        UNDEFINED_13,
-        ACTIVE_SENSING,
-        RESET
-    };
-
-    constexpr auto make_status_byte(unsigned type, unsigned channel) {
-        return type << 4u | channel & 15u;
-    }
-
-    constexpr auto status_get_type(unsigned status_byte) {
-        return status_byte >> 4u;
-    }
-
-    constexpr auto status_get_channel(unsigned status_byte) {
-        return status_byte & 15u;
-    }
-
-    struct note_off_t {
-        uint8_t key{0};
-        uint8_t velocity{0};
-
-        note_off_t(uint8_t k, uint8_t v) : key(k), velocity(v) {}
-
-        note_off_t() = default;
-
-        bool operator==(const note_off_t &other) const {
-            return key == other.key && velocity == other.velocity;
-        }
-    };
-
-    struct note_on_t {
-        uint8_t key;
-        uint8_t velocity;
-
-        note_on_t(uint8_t k, uint8_t v) : key(k), velocity(v) {}
-
-        note_on_t() = default;
-
-        bool operator==(const note_on_t &other) const {
-            return key == other.key && velocity == other.velocity;
-        }
-    };
-
-    struct polyphonic_key_pressure_t {
-        uint8_t key;
-        uint8_t velocity;
-
-        polyphonic_key_pressure_t(uint8_t k, uint8_t v) : key(k), velocity(v) {}
-
-        polyphonic_key_pressure_t() = default;
-    };
-
-    struct control_change_t {
-        uint8_t controller;
-        uint8_t value;
-
-        control_change_t(uint8_t c, uint8_t v) : controller(c), value(v) {}
-
-        control_change_t() = default;
-
-        bool operator==(const control_change_t &other) const {
-            return controller == other.controller && value == other.value;
-        }
-    };
-
-    struct program_change_t {
-        uint8_t program_number;
-
-        explicit program_change_t(uint8_t p) : program_number(p) {}
-
-        program_change_t() = default;
-
-        bool operator==(const program_change_t &other) const {
-            return program_number == other.program_number;
-        }
-    };
-
-    struct channel_pressure_t {
-        uint8_t pressure;
-
-        explicit channel_pressure_t(uint8_t p) : pressure(p) {}
-
-        channel_pressure_t() = default;
-    };
-
-    struct pitch_wheel_change_t {
-        uint16_t pitch_wheel;
-
-        explicit pitch_wheel_change_t(uint8_t l, uint8_t m) : pitch_wheel((m << 8u) | l) {}
-
-        pitch_wheel_change_t() = default;
-
-        [[nodiscard]] uint8_t lsb() const {
-            return pitch_wheel & 0xffu;
-        }
-
-        [[nodiscard]] uint8_t msb() const {
-            return pitch_wheel >> 8u;
-        }
-    };
-
-    struct song_position_pointer_t {
-        uint16_t song_position;
-
-        explicit song_position_pointer_t(uint8_t l, uint8_t m) : song_position((m << 8u) | l) {}
-
-        song_position_pointer_t() = default;
-
-        [[nodiscard]] uint8_t lsb() const {
-            return song_position & 0xffu;
-        }
-
-        [[nodiscard]] uint8_t msb() const {
-            return song_position >> 8u;
-        }
-    };
-
-    struct song_select_t {
-        uint8_t song_select;
-
-        explicit song_select_t(uint8_t s) : song_select(s) {}
-
-        song_select_t() = default;
-    };
-
-    struct sysex_message_t {
-        uint8_t id{0};
-        std::string message;
-
-        sysex_message_t(uint8_t id, std::string r) : id(id), message(std::move(r)) {}
-
-        sysex_message_t(std::initializer_list<uint8_t> l) : id(*l.begin()), message(l.begin() + 1, l.end()) {}
-
-        sysex_message_t() = default;
-
-        bool operator==(const sysex_message_t &other) const {
-            return id == other.id && message == other.message;
-        }
-    };
-
-    using system_message_t = std::variant<sysex_message_t, song_position_pointer_t, song_select_t, uint8_t>;
-
-    struct midi_message_t {
-        uint8_t status{};
-        std::variant<note_off_t, note_on_t, polyphonic_key_pressure_t, control_change_t, program_change_t, channel_pressure_t, pitch_wheel_change_t, system_message_t> message{};
-
-        template<typename T>
-        midi_message_t(uint8_t s, T &&v): status(s), message(std::forward<T>(v)) {}
-
-        midi_message_t() = default;
-    };
-
     using NoteOff = Structure <note_off_t, O<offsetof(note_off_t, key), Sc < uint8_t>>, O<offsetof(note_off_t,
                                                                                                    velocity), Sc<uint8_t>>>;
     using NoteOn = Structure <note_on_t, O<offsetof(note_on_t, key), Sc < uint8_t>>, O<offsetof(note_on_t,
@@ -233,7 +68,7 @@ namespace format::audio::x_midi {
         if (input.empty()) throw empty_sysex_message{};
         for (auto it = input.cbegin() + 1; it != input.cend(); ++it) {
             uint8_t c = *it;
-            if (c & 128u) continue; // ignore real-time in sysex (for now)
+            if (c & 128u) continue; // ignore real-time in sysex (running_status_reader and the buffer decoders return them)
             ret.push_back(c);
         }
         return sysex_message_t{static_cast<uint8_t>(input[0]), ret};
@@ -270,6 +105,79 @@ namespace format::audio::x_midi {
     using MidiMessage = Structure <midi_message_t, O<offsetof(midi_message_t, status), StatusByte>, O<offsetof(
             midi_message_t, message), RemainingMidiMessage>>;
 
+    /*
+     * Stream reader with running status. Messages that start with a status byte are read using MidiMessage.
+     * Sysex messages are read directly; real-time messages inside them are returned before the sysex message.
+     */
+    struct running_status_reader {
+        std::istream &is;
+        running_status_decoder decoder{};
+        std::deque<midi_message_t> pending{};
+        std::string buffer{};
+
+        explicit running_status_reader(std::istream &i) : is(i) {}
+
+        void read(midi_message_t &message) {
+            if (!pending.empty()) {
+                message = std::move(pending.front());
+                pending.pop_front();
+                return;
+            }
+            const auto c = is.peek();
+            if (c == make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE)) {
+                read_sysex(message);
+                return;
+            }
+            if (c == std::char_traits<char>::eof() || c & 128u || !decoder.running_status) {
+                Format<MidiMessage>::reader(is).read(message);
+                decoder.update(message.status);
+                return;
+            }
+            uint8_t data[2];
+            const auto length = status_data_length(decoder.running_status);
+            is.read(reinterpret_cast<char *>(data), length);
+            if (static_cast<size_t>(is.gcount()) != length) throw truncated_midi_message{};
+            decode_midi_message_data(decoder.running_status, data, length, message);
+        }
+
+        void read_sysex(midi_message_t &message) {
+            std::getline(is, buffer, static_cast<char>(0b11110111));
+            if (is.eof()) throw truncated_midi_message{};
+            buffer.push_back(static_cast<char>(0b11110111));
+            size_t length;
+            const auto status = try_decode_midi_message(reinterpret_cast<const uint8_t *>(buffer.data()), buffer.size(),
+                                                        message, length, [this](uint8_t c) {
+                        pending.emplace_back(c, system_message_t{uint8_t{0}});
+                    });
+            if (status != DECODE_OK) throw_decode_status(status, buffer[0]);
+            decoder.update(message.status);
+            if (!pending.empty()) {
+                pending.push_back(std::move(message));
+                message = std::move(pending.front());
+                pending.pop_front();
+            }
+        }
+    };
+
+    /*
+     * Stream writer with running status. Messages that need a status byte are written using MidiMessage.
+     */
+    struct running_status_writer {
+        std::ostream &os;
+        running_status_encoder encoder;
+
+        explicit running_status_writer(std::ostream &o, size_t refresh_interval = 0) : os(o), encoder(refresh_interval) {}
+
+        void write(const midi_message_t &message) {
+            if (!encoder.omit_status(message.status)) {
+                Format<MidiMessage>::writer(os).write(message);
+                return;
+            }
+            uint8_t data[2];
+            os.write(reinterpret_cast<const char *>(data), encode_channel_message_data(message, data));
+        }
+    };
+
     enum controller_t {
         BANK_SELECT_MSB = 0x00,
         MODULATION_WHEEL_MSB,
@@ -530,36 +438,475 @@ namespace format::audio::x_midi {
             "POLY_MODE_ON_OFF_ALL_NOTES_OFF",
     };
 
+    /*
+     * Slot of a controller in controller_state: LSB controllers share the slot of their MSB controller.
+     */
+    constexpr uint8_t controller_slot(uint8_t message_type) {
+        return message_type >= 32u && message_type <= 63u ? message_type - 32u : message_type;
+    }
+
+    /*
+     * Applies a control change to the 128 slots of a channel (see controller_state). Returns true if the value of the
+     * slot changed.
+     */
+    inline bool apply_controller(uint16_t *states, uint8_t message_type, uint8_t value) {
+        auto &state = states[controller_slot(message_type)];
+        const auto previous = state;
+        if (message_type <= 31u) {
+            state = (state & 0xFFu) | value << 8u;
+        } else if (message_type <= 63u) {
+            state = (state & 0xFF00u) | value;
+        } else if (message_type <= 69u) {
+            state = value >= 64u;
+        } else if (message_type == 122) {
+            state = value >= 127u;
+        } else {
+            state = value;
+        }
+        return state != previous;
+    }
+
+    /*
+     * One bit per controller slot, set when the value of the slot changes.
+     */
+    struct controller_dirty_mask {
+        uint64_t bits[2] {};
+
+        void set(uint8_t slot) {
+            bits[slot >> 6u & 1u] |= uint64_t{1} << (slot & 63u);
+        }
+
+        [[nodiscard]] bool test(uint8_t slot) const {
+            return bits[slot >> 6u & 1u] >> (slot & 63u) & 1u;
+        }
+
+        [[nodiscard]] bool any() const {
+            return bits[0] | bits[1];
+        }
+
+        /*
+         * Calls `f(uint8_t slot)` for every set bit in ascending order and clears all bits.
+         */
+        template<typename F>
+        void drain(F &&f) {
+            for (unsigned word = 0; word < 2; ++word) {
+                auto b = bits[word];
+                bits[word] = 0;
+                for (; b; b &= b - 1) f(static_cast<uint8_t>(word * 64u + __builtin_ctzll(b)));
+            }
+        }
+    };
+
     struct controller_state {
         uint16_t states[128] {};
+        controller_dirty_mask dirty {};
+
+        [[nodiscard]] uint16_t get(uint8_t message_type) const {
+            return states[controller_slot(message_type)];
+        }
 
-        controller_state() {
-            memset(states, 0, 128);
+        /*
+         * Returns true (and reports the change) if the value changed.
+         */
+        bool apply(uint8_t message_type, uint8_t value) {
+            if (!apply_controller(states, message_type, value)) return false;
+            const auto slot = controller_slot(message_type);
+            dirty.set(slot);
+            controller_changed(static_cast<controller_t>(message_type), states[slot]);
+            return true;
         }
 
-        [[nodiscard]] uint16_t get(uint8_t message_type) const {
-            if (message_type >= 32u && message_type <= 63u) return states[message_type - 32u];
-            else return states[message_type];
+        /*
+         * Calls `f(controller_t slot, uint16_t value)` for every slot that changed since the last call.
+         */
+        template<typename F>
+        void drain(F &&f) {
+            dirty.drain([this, &f](uint8_t slot) {
+                f(static_cast<controller_t>(slot), states[slot]);
+            });
+        }
+
+        virtual void controller_changed(controller_t controller, uint16_t value) {
+        }
+    };
+
+    /*
+     * Default change notification of controller_bank: none.
+     */
+    struct ignore_controller_changes {
+        void operator()(uint8_t, controller_t, uint16_t) const {}
+    };
+
+    /*
+     * Controller state of all 16 channels in one contiguous block, stored like in controller_state.
+     * Changes are passed to `notify(channel, controller, value)`, which is resolved at compile time, and marked in the
+     * dirty mask of their channel.
+     */
+    template<typename Notify = ignore_controller_changes>
+    struct controller_bank {
+        Notify notify;
+        uint16_t states[16][128] {};
+        controller_dirty_mask dirty[16] {};
+
+        explicit controller_bank(Notify n = Notify{}) : notify(std::move(n)) {}
+
+        [[nodiscard]] uint16_t get(uint8_t channel, uint8_t message_type) const {
+            return states[channel & 15u][controller_slot(message_type)];
+        }
+
+        bool apply(uint8_t channel, uint8_t message_type, uint8_t value) {
+            channel &= 15u;
+            auto *channel_states = states[channel];
+            if (!apply_controller(channel_states, message_type, value)) return false;
+            const auto slot = controller_slot(message_type);
+            dirty[channel].set(slot);
+            notify(channel, static_cast<controller_t>(message_type), channel_states[slot]);
+            return true;
+        }
+
+        /*
+         * Applies all control changes in [begin, end) (e.g. midi_event_t); other messages are ignored.
+         */
+        template<typename It>
+        void apply(It begin, It end) {
+            for (; begin != end; ++begin) {
+                const auto &event = *begin;
+                if (status_get_type(event.status) != CONTROLCHANGE) continue;
+                apply(status_get_channel(event.status), event.data1, event.data2);
+            }
+        }
+
+        /*
+         * Calls `f(controller_t slot, uint16_t value)` for every slot of `channel` that changed since the last call.
+         */
+        template<typename F>
+        void drain(uint8_t channel, F &&f) {
+            const auto *channel_states = states[channel & 15u];
+            dirty[channel & 15u].drain([channel_states, &f](uint8_t slot) {
+                f(static_cast<controller_t>(slot), channel_states[slot]);
+            });
+        }
+
+        void reset() {
+            memset(states, 0, sizeof(states));
+            for (auto &mask : dirty) mask = {};
+        }
+    };
+
+    // RPN 127/127: no parameter selected
+    constexpr uint16_t NULL_PARAMETER_NUMBER = 0x3fffu;
+    // increment/decrement of a parameter whose value was not sent since it was selected
+    constexpr uint16_t UNKNOWN_PARAMETER_VALUE = 0xffffu;
+
+    /*
+     * Resolved RPN/NRPN data entry: 14-bit parameter number and value (MSB << 7 | LSB).
+     * `delta` is +1/-1 for data increment/decrement and 0 for data entry.
+     */
+    struct parameter_event_t {
+        uint8_t channel;
+        bool registered;
+        uint16_t parameter;
+        uint16_t value;
+        int8_t delta{0};
+
+        bool operator==(const parameter_event_t &other) const {
+            return channel == other.channel && registered == other.registered && parameter == other.parameter &&
+                   value == other.value && delta == other.delta;
+        }
+    };
+
+    /*
+     * Incremental per-channel decoder for registered and non-registered parameter numbers.
+     * Parameter number controllers (101/100, 99/98) select a parameter, data entry controllers (6/38) and data
+     * increment/decrement (96/97) change its value and pass a parameter_event_t to `handler`. A data entry MSB resets
+     * the LSB of the value, so a complete sequence 101, 100, 6, 38 reports the coarse value first and then the full
+     * value. Increment and decrement change the 14-bit value by one and are only reported if the value changes; if no
+     * data entry was seen since the parameter was selected, they are reported with UNKNOWN_PARAMETER_VALUE and the
+     * receiver applies `delta` itself. Reselecting the same parameter keeps its value. The null parameter number
+     * (127/127) deselects the parameter; data entry without a selected parameter is ignored.
+     */
+    template<typename Handler>
+    struct parameter_decoder {
+        struct channel_t {
+            uint8_t parameter_msb{127};
+            uint8_t parameter_lsb{127};
+            bool registered{true};
+            bool has_value{false};
+            uint16_t value{0};
+
+            [[nodiscard]] uint16_t parameter() const {
+                return parameter_msb << 7u | parameter_lsb;
+            }
+        };
+
+        Handler handler;
+        channel_t channels[16] {};
+
+        explicit parameter_decoder(Handler h) : handler(std::move(h)) {}
+
+        /*
+         * Returns true if the control change belongs to an RPN/NRPN sequence.
+         */
+        bool apply(uint8_t channel, uint8_t controller, uint8_t value) {
+            auto &state = channels[channel & 15u];
+            switch (controller) {
+                case REGISTERED_PARAMETER_NUMBER_MSB:
+                case NON_REGISTERED_PARAMETER_NUMBER_MSB:
+                    select(state, controller == REGISTERED_PARAMETER_NUMBER_MSB, true, value);
+                    return true;
+                case REGISTERED_PARAMETER_NUMBER_LSB:
+                case NON_REGISTERED_PARAMETER_NUMBER_LSB:
+                    select(state, controller == REGISTERED_PARAMETER_NUMBER_LSB, false, value);
+                    return true;
+                case DATA_ENTRY_MSB:
+                    state.value = (value & 127u) << 7u;
+                    state.has_value = true;
+                    break;
+                case DATA_ENTRY_LSB:
+                    state.value = (state.value & 0x3f80u) | (value & 127u);
+                    state.has_value = true;
+                    break;
+                case DATA_ENTRY_PLUS_1:
+                case DATA_ENTRY_MINUS_1: {
+                    const int8_t delta = controller == DATA_ENTRY_PLUS_1 ? 1 : -1;
+                    if (!state.has_value) {
+                        report(channel, state, UNKNOWN_PARAMETER_VALUE, delta);
+                        return true;
+                    }
+                    if (delta > 0 ? state.value == 0x3fffu : state.value == 0) return true;
+                    state.value += delta;
+                    report(channel, state, state.value, delta);
+                    return true;
+                }
+                default:
+                    return false;
+            }
+            report(channel, state, state.value, 0);
+            return true;
+        }
+
+        /*
+         * Applies all control changes in [begin, end) (e.g. midi_event_t); other messages are ignored.
+         */
+        template<typename It>
+        void apply(It begin, It end) {
+            for (; begin != end; ++begin) {
+                const auto &event = *begin;
+                if (status_get_type(event.status) != CONTROLCHANGE) continue;
+                apply(status_get_channel(event.status), event.data1, event.data2);
+            }
+        }
+
+        void reset() {
+            for (auto &state : channels) state = {};
         }
 
-        void apply(uint8_t message_type, uint8_t value) {
-            if (message_type <= 31u) {
-                states[message_type] = (states[message_type] & 0xFFu) | value << 8u;
-            } else if (message_type <= 63u) {
-                states[message_type - 32u] = (states[message_type - 32u] & 0xFF00u) | value;
-                controller_changed(static_cast<controller_t>(message_type), states[message_type - 32u]);
+        void report(uint8_t channel, const channel_t &state, uint16_t value, int8_t delta) {
+            const auto parameter = state.parameter();
+            if (parameter != NULL_PARAMETER_NUMBER) {
+                const auto c = static_cast<uint8_t>(channel & 15u);
+                handler(parameter_event_t{c, state.registered, parameter, value, delta});
+            }
+        }
+
+        static void select(channel_t &state, bool registered, bool msb, uint8_t number) {
+            auto next = state;
+            // switching between RPN and NRPN starts a new parameter number
+            if (next.registered != registered) {
+                next.registered = registered;
+                next.parameter_msb = next.parameter_lsb = 127;
+            }
+            (msb ? next.parameter_msb : next.parameter_lsb) = number & 127u;
+            if (next.registered != state.registered || next.parameter() != state.parameter()) {
+                next.has_value = false;
+                next.value = 0;
+            }
+            state = next;
+        }
+    };
+
+    template<typename Handler>
+    parameter_decoder<Handler> make_parameter_decoder(Handler handler) {
+        return parameter_decoder<Handler>(std::move(handler));
+    }
+
+    /*
+     * Set of 128 keys.
+     */
+    struct key_set {
+        uint64_t bits[2] {};
+
+        /*
+         * Returns true if the key was not in the set.
+         */
+        bool insert(uint8_t key) {
+            auto &word = bits[key >> 6u & 1u];
+            const auto bit = uint64_t{1} << (key & 63u);
+            const bool inserted = !(word & bit);
+            word |= bit;
+            return inserted;
+        }
+
+        /*
+         * Returns true if the key was in the set.
+         */
+        bool erase(uint8_t key) {
+            auto &word = bits[key >> 6u & 1u];
+            const auto bit = uint64_t{1} << (key & 63u);
+            const bool erased = word & bit;
+            word &= ~bit;
+            return erased;
+        }
+
+        [[nodiscard]] bool contains(uint8_t key) const {
+            return bits[key >> 6u & 1u] >> (key & 63u) & 1u;
+        }
+
+        [[nodiscard]] size_t size() const {
+            return __builtin_popcountll(bits[0]) + __builtin_popcountll(bits[1]);
+        }
+
+        [[nodiscard]] bool empty() const {
+            return !(bits[0] | bits[1]);
+        }
+
+        void clear() {
+            bits[0] = bits[1] = 0;
+        }
+
+        /*
+         * Calls `f(uint8_t key)` for every key in ascending order.
+         */
+        template<typename F>
+        void for_each(F &&f) const {
+            for (unsigned word = 0; word < 2; ++word) {
+                for (auto b = bits[word]; b; b &= b - 1) f(static_cast<uint8_t>(word * 64u + __builtin_ctzll(b)));
+            }
+        }
+    };
+
+    /*
+     * Keeps track of sounding notes per channel. A key sounds while it is held, or after its note-off while the
+     * damper pedal (DAMPER_PEDAL_ON_OFF_SUSTAIN) is down. Note-on with velocity 0 is a note-off.
+     * ALL_NOTES_OFF and the mode messages release all held keys (sustained by the pedal like note-offs), ALL_SOUND_OFF
+     * silences the channel and RESET_ALL_CONTROLLERS releases the pedal. Polyphony counts are kept up to date.
+     */
+    struct note_tracker {
+        struct channel_t {
+            key_set held{};
+            key_set sounding{};
+            bool pedal{false};
+            uint8_t polyphony{0};
+        };
+
+        channel_t channels[16] {};
+        size_t polyphony{0};
+
+        void note_on(uint8_t channel, uint8_t key, uint8_t velocity) {
+            if (velocity == 0) {
+                note_off(channel, key);
                 return;
-            } else if (message_type <= 69u) {
-                states[message_type] = value >= 64u;
-            } else if (message_type == 122) {
-                states[message_type] = value >= 127u;
-            } else {
-                states[message_type] = value;
             }
-            controller_changed(static_cast<controller_t>(message_type), states[message_type]);
+            auto &state = channels[channel & 15u];
+            state.held.insert(key & 127u);
+            if (state.sounding.insert(key & 127u)) add(state, 1);
         }
 
-        virtual void controller_changed(controller_t controller, uint16_t value) {
+        void note_off(uint8_t channel, uint8_t key) {
+            auto &state = channels[channel & 15u];
+            state.held.erase(key & 127u);
+            if (!state.pedal && state.sounding.erase(key & 127u)) add(state, -1);
+        }
+
+        void control_change(uint8_t channel, uint8_t controller, uint8_t value) {
+            auto &state = channels[channel & 15u];
+            if (controller == DAMPER_PEDAL_ON_OFF_SUSTAIN) {
+                state.pedal = value >= 64u;
+                if (!state.pedal) release_pedal(state);
+            } else if (controller == ALL_SOUND_OFF) {
+                state.held.clear();
+                state.sounding.clear();
+                add(state, -state.polyphony);
+            } else if (controller == RESET_ALL_CONTROLLERS) {
+                state.pedal = false;
+                release_pedal(state);
+            } else if (controller >= ALL_NOTES_OFF) {
+                state.held.clear();
+                if (!state.pedal) release_pedal(state);
+            }
+        }
+
+        void apply(uint8_t status, uint8_t data1, uint8_t data2) {
+            const auto channel = status_get_channel(status);
+            switch (status_get_type(status)) {
+                case NOTEON:
+                    note_on(channel, data1, data2);
+                    break;
+                case NOTEOFF:
+                    note_off(channel, data1);
+                    break;
+                case CONTROLCHANGE:
+                    control_change(channel, data1, data2);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        /*
+         * Applies all events in [begin, end) (e.g. midi_event_t).
+         */
+        template<typename It>
+        void apply(It begin, It end) {
+            for (; begin != end; ++begin) apply(begin->status, begin->data1, begin->data2);
+        }
+
+        [[nodiscard]] const key_set &sounding(uint8_t channel) const {
+            return channels[channel & 15u].sounding;
+        }
+
+        [[nodiscard]] size_t channel_polyphony(uint8_t channel) const {
+            return channels[channel & 15u].polyphony;
+        }
+
+        /*
+         * Passes the messages that silence all sounding notes to `f(const midi_event_t &)`: a pedal release for
+         * channels with the pedal down (which ends all sustained notes) and a note-off for every key that is still
+         * held. The tracker is updated as if the messages had been sent.
+         */
+        template<typename F>
+        void panic(F &&f) {
+            for (uint8_t channel = 0; channel < 16; ++channel) {
+                auto &state = channels[channel];
+                if (state.sounding.empty()) continue;
+                if (state.pedal) {
+                    f(midi_event_t{static_cast<uint8_t>(make_status_byte(CONTROLCHANGE, channel)),
+                                   DAMPER_PEDAL_ON_OFF_SUSTAIN, 0});
+                }
+                state.held.for_each([&f, channel](uint8_t key) {
+                    f(midi_event_t{static_cast<uint8_t>(make_status_byte(NOTEOFF, channel)), key, 0});
+                });
+                state.held.clear();
+                state.sounding.clear();
+                state.pedal = false;
+                add(state, -state.polyphony);
+            }
+        }
+
+        void reset() {
+            for (auto &state : channels) state = {};
+            polyphony = 0;
+        }
+
+        void release_pedal(channel_t &state) {
+            state.sounding = state.held;
+            const auto count = static_cast<int>(state.sounding.size());
+            add(state, count - state.polyphony);
+        }
+
+        void add(channel_t &state, int delta) {
+            state.polyphony += delta;
+            polyphony += delta;
         }
     };
 
@@ -0,0 +1,427 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_DECODER_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_DECODER_HPP
+
+#include <format-commons/audio/x-midi/messages.hpp>
+#include <format-commons/audio/x-midi/scan.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <exception>
+
+namespace format::audio::x_midi {
+
+    struct empty_sysex_message : public std::exception {
+    };
+
+    struct truncated_midi_message : public std::exception {
+    };
+
+    struct invalid_status_byte : public std::exception {
+        uint8_t value;
+
+        explicit invalid_status_byte(uint8_t v) : value(v) {}
+    };
+
+    enum decode_status {
+        DECODE_OK,
+        DECODE_NEED_MORE_DATA,
+        DECODE_END_OF_INPUT,
+        DECODE_INVALID_STATUS,
+        DECODE_EMPTY_SYSEX
+    };
+
+    /*
+     * Kind of message a status byte starts, in the order of the alternatives of midi_message_t.
+     */
+    enum status_kind {
+        STATUS_NOTE_OFF,
+        STATUS_NOTE_ON,
+        STATUS_POLYPHONIC_KEY_PRESSURE,
+        STATUS_CONTROL_CHANGE,
+        STATUS_PROGRAM_CHANGE,
+        STATUS_CHANNEL_PRESSURE,
+        STATUS_PITCH_WHEEL_CHANGE,
+        STATUS_SYSEX,
+        STATUS_SONG_POSITION_POINTER,
+        STATUS_SONG_SELECT,
+        // system common messages without data (undefined, tune request, end of exclusive)
+        STATUS_SYSTEM,
+        STATUS_REALTIME,
+        // data byte (high bit clear)
+        STATUS_NONE
+    };
+
+    struct status_info_t {
+        uint8_t kind;
+        // number of data bytes following the status byte (sysex messages are terminated instead)
+        uint8_t data_length;
+    };
+
+    struct status_table_t {
+        status_info_t entries[256];
+
+        constexpr const status_info_t &operator[](uint8_t status) const {
+            return entries[status];
+        }
+    };
+
+    constexpr status_table_t make_status_table() {
+        status_table_t table{};
+        for (unsigned status = 0; status < 256; ++status) {
+            auto &entry = table.entries[status];
+            if (status < 0x80u) {
+                entry = {STATUS_NONE, 0};
+            } else if (status_get_type(status) != SYSTEMMESSAGE) {
+                const auto type = status_get_type(status);
+                const uint8_t length = type == PROGRAMCHANGE || type == CHANNELPRESSURE ? 1 : 2;
+                entry = {static_cast<uint8_t>(STATUS_NOTE_OFF + (type - NOTEOFF)), length};
+            } else {
+                switch (status_get_channel(status)) {
+                    case SYSEX_MESSAGE:
+                        entry = {STATUS_SYSEX, 0};
+                        break;
+                    case SONG_POSITION_POINTER:
+                        entry = {STATUS_SONG_POSITION_POINTER, 2};
+                        break;
+                    case SONG_SELECT:
+                        entry = {STATUS_SONG_SELECT, 1};
+                        break;
+                    default:
+                        entry = {static_cast<uint8_t>(status >= 0xf8u ? STATUS_REALTIME : STATUS_SYSTEM), 0};
+                        break;
+                }
+            }
+        }
+        return table;
+    }
+
+    /*
+     * Kind and data length of every status byte, so decoders dispatch with a single lookup.
+     */
+    inline constexpr status_table_t status_table = make_status_table();
+
+    /*
+     * Number of data bytes following a status byte (sysex messages are terminated instead).
+     */
+    constexpr size_t status_data_length(uint8_t status) {
+        return status_table[status].data_length;
+    }
+
+    /*
+     * Default real-time handler of the buffer decoders: real-time bytes inside sysex messages are skipped, like
+     * vectorToSysEx does.
+     */
+    struct skip_realtime {
+        void operator()(uint8_t) const noexcept {}
+    };
+
+    /*
+     * Copies a sysex payload to `out`, skipping real-time bytes (and stray status bytes).
+     * Every skipped real-time byte is passed to `realtime(uint8_t)` before the payload is complete.
+     * Returns the number of bytes written (at most end - begin).
+     */
+    template<typename R = skip_realtime>
+    size_t copy_sysex_payload(const uint8_t *begin, const uint8_t *end, char *out, R &&realtime = R{}) noexcept {
+        auto o = out;
+        // copy whole runs of data bytes between status bytes
+        for (auto it = begin; it != end; ++it) {
+            const auto status = find_status_byte(it, end);
+            memcpy(o, it, status - it);
+            o += status - it;
+            if (status == end) break;
+            if (*status >= 0xf8u) realtime(*status);
+            it = status;
+        }
+        return o - out;
+    }
+
+    /*
+     * Decodes the data bytes following status byte `status`.
+     * `length` is set to the number of bytes consumed, not counting the status byte.
+     * Never throws; returns DECODE_NEED_MORE_DATA, DECODE_EMPTY_SYSEX or DECODE_INVALID_STATUS (data byte as status)
+     * if the message cannot be decoded.
+     * Real-time bytes inside a sysex message are passed to `realtime(uint8_t)` (see copy_sysex_payload).
+     */
+    template<typename R = skip_realtime>
+    decode_status try_decode_midi_message_data(uint8_t status, const uint8_t *data, size_t size,
+                                               midi_message_t &message, size_t &length, R &&realtime = R{}) noexcept {
+        const auto &info = status_table[status];
+        length = info.data_length;
+        if (size < length) return DECODE_NEED_MORE_DATA;
+        switch (info.kind) {
+            case STATUS_NOTE_OFF:
+                message.message = note_off_t(data[0], data[1]);
+                break;
+            case STATUS_NOTE_ON:
+                message.message = note_on_t(data[0], data[1]);
+                break;
+            case STATUS_POLYPHONIC_KEY_PRESSURE:
+                message.message = polyphonic_key_pressure_t(data[0], data[1]);
+                break;
+            case STATUS_CONTROL_CHANGE:
+                message.message = control_change_t(data[0], data[1]);
+                break;
+            case STATUS_PROGRAM_CHANGE:
+                message.message = program_change_t(data[0]);
+                break;
+            case STATUS_CHANNEL_PRESSURE:
+                message.message = channel_pressure_t(data[0]);
+                break;
+            case STATUS_PITCH_WHEEL_CHANGE:
+                message.message = pitch_wheel_change_t(data[0], data[1]);
+                break;
+            case STATUS_SYSEX: {
+                const auto end = find_sysex_end(data, data + size);
+                if (end == data + size) return DECODE_NEED_MORE_DATA;
+                if (end == data) return DECODE_EMPTY_SYSEX;
+                // reuse the payload buffer if the previous message was a sysex message, too
+                auto *system = std::get_if<system_message_t>(&message.message);
+                if (!system) system = &message.message.emplace<system_message_t>();
+                auto *sysex = std::get_if<sysex_message_t>(system);
+                if (!sysex) sysex = &system->emplace<sysex_message_t>();
+                sysex->id = data[0];
+                sysex->message.resize(end - data - 1);
+                sysex->message.resize(copy_sysex_payload(data + 1, end, sysex->message.data(), realtime));
+                length = end - data + 1;
+                break;
+            }
+            case STATUS_SONG_POSITION_POINTER:
+                message.message = system_message_t{song_position_pointer_t(data[0], data[1])};
+                break;
+            case STATUS_SONG_SELECT:
+                message.message = system_message_t{song_select_t(data[0])};
+                break;
+            case STATUS_SYSTEM:
+            case STATUS_REALTIME:
+                // Default<Sc<void>>: no payload
+                message.message = system_message_t{uint8_t{0}};
+                break;
+            default:
+                return DECODE_INVALID_STATUS;
+        }
+        message.status = status;
+        return DECODE_OK;
+    }
+
+    /*
+     * Decodes a single message from a contiguous buffer without throwing.
+     * Returns DECODE_END_OF_INPUT if the buffer is empty. On success, `length` is set to the number of bytes consumed.
+     */
+    template<typename R = skip_realtime>
+    decode_status try_decode_midi_message(const uint8_t *data, size_t size, midi_message_t &message, size_t &length,
+                                          R &&realtime = R{}) noexcept {
+        if (size == 0) return DECODE_END_OF_INPUT;
+        if (!(data[0] & 128u)) return DECODE_INVALID_STATUS;
+        const auto status = try_decode_midi_message_data(data[0], data + 1, size - 1, message, length, realtime);
+        if (status == DECODE_OK) ++length;
+        return status;
+    }
+
+#if __cpp_exceptions
+    [[noreturn]] inline void throw_decode_status(decode_status status, uint8_t value) {
+        switch (status) {
+            case DECODE_INVALID_STATUS:
+                throw invalid_status_byte{value};
+            case DECODE_EMPTY_SYSEX:
+                throw empty_sysex_message{};
+            default:
+                throw truncated_midi_message{};
+        }
+    }
+
+    inline size_t decode_midi_message_data(uint8_t status, const uint8_t *data, size_t size, midi_message_t &message) {
+        size_t length = 0;
+        const auto result = try_decode_midi_message_data(status, data, size, message, length);
+        if (result != DECODE_OK) throw_decode_status(result, status);
+        return length;
+    }
+
+    /*
+     * Decodes a single message from a contiguous buffer, bypassing std::istream.
+     * The result is identical to Format<MidiMessage>::reader(...).read(message).
+     * Returns the number of bytes consumed.
+     */
+    inline size_t decode_midi_message(const uint8_t *data, size_t size, midi_message_t &message) {
+        size_t length = 0;
+        const auto result = try_decode_midi_message(data, size, message, length);
+        if (result != DECODE_OK) throw_decode_status(result, size ? data[0] : 0);
+        return length;
+    }
+#endif
+
+    /*
+     * Result of decoding several messages at once.
+     * status is DECODE_OK if the output buffer is full, DECODE_END_OF_INPUT if all input was consumed, or the reason
+     * why the message following the last decoded message could not be decoded.
+     */
+    struct decode_batch_t {
+        size_t count{0};
+        size_t consumed{0};
+        decode_status status{DECODE_OK};
+    };
+
+    template<typename D>
+    decode_batch_t decode_batch(D &&try_decode, const uint8_t *data, size_t size, midi_message_t *out, size_t count) {
+        decode_batch_t result{};
+        while (result.count != count) {
+            size_t length = 0;
+            result.status = try_decode(data + result.consumed, size - result.consumed, out[result.count], length);
+            if (result.status != DECODE_OK) return result;
+            result.consumed += length;
+            ++result.count;
+        }
+        if (result.consumed == size) result.status = DECODE_END_OF_INPUT;
+        return result;
+    }
+
+    /*
+     * Decodes up to `count` messages from a contiguous buffer into `out`.
+     */
+    inline decode_batch_t decode_midi_messages(const uint8_t *data, size_t size, midi_message_t *out, size_t count) {
+        return decode_batch([](const uint8_t *d, size_t s, midi_message_t &m, size_t &l) {
+            return try_decode_midi_message(d, s, m, l);
+        }, data, size, out, count);
+    }
+
+    /*
+     * Decoder for streams that use running status.
+     * Channel messages set the running status, system common messages clear it and real-time messages leave it untouched.
+     * Data bytes where a status byte is expected are decoded using the running status.
+     */
+    struct running_status_decoder {
+        uint8_t running_status{0};
+
+        void update(uint8_t status) {
+            if (status < 0xf0u) running_status = status;
+            else if (status < 0xf8u) running_status = 0;
+        }
+
+        void reset() {
+            running_status = 0;
+        }
+
+        template<typename R = skip_realtime>
+        decode_status try_decode(const uint8_t *data, size_t size, midi_message_t &message, size_t &length,
+                                 R &&realtime = R{}) noexcept {
+            if (size == 0) return DECODE_END_OF_INPUT;
+            if (data[0] & 128u) {
+                const auto status = try_decode_midi_message(data, size, message, length, realtime);
+                if (status == DECODE_OK) update(data[0]);
+                return status;
+            }
+            if (!running_status) return DECODE_INVALID_STATUS;
+            return try_decode_midi_message_data(running_status, data, size, message, length);
+        }
+
+#if __cpp_exceptions
+        size_t decode(const uint8_t *data, size_t size, midi_message_t &message) {
+            size_t length = 0;
+            const auto result = try_decode(data, size, message, length);
+            if (result != DECODE_OK) throw_decode_status(result, size ? data[0] : 0);
+            return length;
+        }
+#endif
+
+        decode_batch_t decode(const uint8_t *data, size_t size, midi_message_t *out, size_t count) {
+            return decode_batch([this](const uint8_t *d, size_t s, midi_message_t &m, size_t &l) {
+                return try_decode(d, s, m, l);
+            }, data, size, out, count);
+        }
+    };
+
+    /*
+     * Writes the data bytes of a channel message to `out` (at least two bytes). Returns the number of bytes written.
+     */
+    inline size_t encode_channel_message_data(const midi_message_t &message, uint8_t *out) {
+        switch (status_get_type(message.status)) {
+            case NOTEOFF: {
+                const auto &m = std::get<note_off_t>(message.message);
+                out[0] = m.key;
+                out[1] = m.velocity;
+                return 2;
+            }
+            case NOTEON: {
+                const auto &m = std::get<note_on_t>(message.message);
+                out[0] = m.key;
+                out[1] = m.velocity;
+                return 2;
+            }
+            case POLYPHONICKEYPRESSURE: {
+                const auto &m = std::get<polyphonic_key_pressure_t>(message.message);
+                out[0] = m.key;
+                out[1] = m.velocity;
+                return 2;
+            }
+            case CONTROLCHANGE: {
+                const auto &m = std::get<control_change_t>(message.message);
+                out[0] = m.controller;
+                out[1] = m.value;
+                return 2;
+            }
+            case PROGRAMCHANGE:
+                out[0] = std::get<program_change_t>(message.message).program_number;
+                return 1;
+            case CHANNELPRESSURE:
+                out[0] = std::get<channel_pressure_t>(message.message).pressure;
+                return 1;
+            default: {
+                const auto &m = std::get<pitch_wheel_change_t>(message.message);
+                out[0] = m.lsb();
+                out[1] = m.msb();
+                return 2;
+            }
+        }
+    }
+
+    /*
+     * Decides which status bytes can be omitted when writing with running status.
+     * System common messages reset the running status, real-time messages do not.
+     * If refresh_interval is not 0, the status byte is repeated after refresh_interval omitted status bytes.
+     */
+    struct running_status_encoder {
+        size_t refresh_interval{0};
+        uint8_t running_status{0};
+        size_t omitted{0};
+
+        explicit running_status_encoder(size_t refresh = 0) : refresh_interval(refresh) {}
+
+        bool omit_status(uint8_t status) {
+            if (status >= 0xf8u) return false;
+            if (status >= 0xf0u) {
+                reset();
+                return false;
+            }
+            if (status == running_status && (!refresh_interval || omitted < refresh_interval)) {
+                ++omitted;
+                return true;
+            }
+            running_status = status;
+            omitted = 0;
+            return false;
+        }
+
+        void reset() {
+            running_status = 0;
+            omitted = 0;
+        }
+    };
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_DECODER_HPP
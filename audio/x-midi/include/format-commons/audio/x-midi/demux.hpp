@@ -0,0 +1,102 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_DEMUX_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_DEMUX_HPP
+
+#include <format-commons/audio/x-midi/messages.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace format::audio::x_midi {
+
+    // index of the system message output of channel_demux
+    constexpr size_t DEMUX_SYSTEM = 16;
+
+    struct demux_table_t {
+        uint8_t entries[256];
+
+        constexpr uint8_t operator[](uint8_t status) const {
+            return entries[status];
+        }
+    };
+
+    constexpr demux_table_t make_demux_table() {
+        demux_table_t table{};
+        for (unsigned status = 0; status < 256; ++status) {
+            const bool channel = status >= 0x80u && status_get_type(status) != SYSTEMMESSAGE;
+            table.entries[status] = channel ? status_get_channel(status) : DEMUX_SYSTEM;
+        }
+        return table;
+    }
+
+    /*
+     * Output of channel_demux for every status byte: the channel for channel messages, DEMUX_SYSTEM otherwise.
+     */
+    inline constexpr demux_table_t demux_table = make_demux_table();
+
+    template<typename S, typename E, typename = void>
+    struct has_try_push : std::false_type {
+    };
+
+    template<typename S, typename E>
+    struct has_try_push<S, E, std::void_t<decltype(std::declval<S &>().try_push(std::declval<const E &>()))>>
+            : std::true_type {
+    };
+
+    /*
+     * Routes events (anything with a `status` member, e.g. midi_event_t or midi_message_t) to one of 16 channel
+     * outputs or the system message output with a single table lookup.
+     * Outputs are pointers to sinks, e.g. a spsc_ring_buffer per worker thread (events are passed to try_push) or
+     * handler objects (called with the event). Events for missing outputs and events rejected by full queues are
+     * counted in `dropped`.
+     */
+    template<typename Sink>
+    struct channel_demux {
+        Sink *outputs[DEMUX_SYSTEM + 1]{};
+        size_t dropped{0};
+
+        void connect(size_t output, Sink *sink) {
+            outputs[output] = sink;
+        }
+
+        template<typename E>
+        bool route(const E &event) {
+            auto *sink = outputs[demux_table[event.status]];
+            bool delivered = sink != nullptr;
+            if (delivered) {
+                if constexpr (has_try_push<Sink, E>::value) {
+                    delivered = sink->try_push(event);
+                } else {
+                    (*sink)(event);
+                }
+            }
+            if (!delivered) ++dropped;
+            return delivered;
+        }
+
+        template<typename It>
+        void route(It begin, It end) {
+            for (; begin != end; ++begin) route(*begin);
+        }
+    };
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_DEMUX_HPP
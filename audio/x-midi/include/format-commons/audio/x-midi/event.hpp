@@ -0,0 +1,247 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_EVENT_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_EVENT_HPP
+
+#include <format-commons/audio/x-midi/messages.hpp>
+#include <format-commons/audio/x-midi/decoder.hpp>
+
+#include <cstring>
+#include <memory_resource>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace format::audio::x_midi {
+
+    /*
+     * Compact representation of a message.
+     * data1/data2 hold the data bytes in wire order. For sysex messages, data1 holds the id. Payloads of up to
+     * four bytes are stored in `sysex` directly (data2 holds 0x80 | size), longer payloads are stored in a sysex_heap
+     * and `sysex` is their handle. Events read from Standard MIDI Files store sysex continuation (0xF7) and meta (0xFF,
+     * data1 holds the type) payloads the same way. Only events with MIDI_EVENT_PAYLOAD set in `flags` carry a payload;
+     * a wire EOX or System Reset has the same status but no payload.
+     * A sysex message split across SMF events starts with a 0xF0 event marked MIDI_EVENT_SYSEX_UNTERMINATED and ends
+     * with the 0xF7 event marked MIDI_EVENT_SYSEX_TERMINATOR.
+     */
+    constexpr uint8_t MIDI_EVENT_PAYLOAD = 1;
+    constexpr uint8_t MIDI_EVENT_SYSEX_UNTERMINATED = 2;
+    constexpr uint8_t MIDI_EVENT_SYSEX_TERMINATOR = 4;
+
+    struct midi_event_t {
+        uint8_t status{};
+        uint8_t data1{};
+        uint8_t data2{};
+        uint8_t flags{};
+        uint32_t sysex{};
+
+        [[nodiscard]] bool is_sysex() const {
+            return status == make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE);
+        }
+
+        [[nodiscard]] bool has_payload() const {
+            return flags & MIDI_EVENT_PAYLOAD;
+        }
+
+        [[nodiscard]] bool has_inline_sysex() const {
+            return has_payload() && data2 & 128u;
+        }
+
+        bool operator==(const midi_event_t &other) const {
+            return status == other.status && data1 == other.data1 && data2 == other.data2 && flags == other.flags &&
+                   sysex == other.sysex;
+        }
+    };
+
+    static_assert(sizeof(midi_event_t) == 8);
+    static_assert(std::is_trivially_copyable_v<midi_event_t>);
+
+    /*
+     * Out-of-line storage for sysex payloads referenced by midi_event_t.
+     * All memory is taken from `resource`, e.g. a std::pmr::monotonic_buffer_resource supplied by the caller.
+     */
+    struct sysex_heap {
+        struct entry_t {
+            uint32_t offset;
+            uint32_t size;
+        };
+
+        std::pmr::vector<char> bytes;
+        std::pmr::vector<entry_t> entries;
+
+        explicit sysex_heap(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+                : bytes(resource), entries(resource) {}
+
+        uint32_t push(std::string_view payload) {
+            entries.push_back({static_cast<uint32_t>(bytes.size()), static_cast<uint32_t>(payload.size())});
+            bytes.insert(bytes.end(), payload.begin(), payload.end());
+            return entries.size() - 1;
+        }
+
+        /*
+         * Copies a payload from the wire directly into the heap (see copy_sysex_payload).
+         */
+        template<typename R = skip_realtime>
+        uint32_t push(const uint8_t *begin, const uint8_t *end, R &&realtime = R{}) {
+            const auto offset = bytes.size();
+            bytes.resize(offset + (end - begin));
+            bytes.resize(offset + copy_sysex_payload(begin, end, bytes.data() + offset, realtime));
+            entries.push_back({static_cast<uint32_t>(offset), static_cast<uint32_t>(bytes.size() - offset)});
+            return entries.size() - 1;
+        }
+
+        [[nodiscard]] std::string_view get(uint32_t handle) const {
+            const auto &e = entries[handle];
+            return {bytes.data() + e.offset, e.size};
+        }
+
+        /*
+         * Payload of a sysex event, either stored inline or in this heap. Empty for events without a payload.
+         */
+        [[nodiscard]] std::string_view get(const midi_event_t &event) const {
+            if (!event.has_payload()) return {};
+            if (event.has_inline_sysex()) {
+                return {reinterpret_cast<const char *>(&event.sysex), event.data2 & 7u};
+            }
+            return get(event.sysex);
+        }
+
+        [[nodiscard]] size_t size() const {
+            return entries.size();
+        }
+
+        void clear() {
+            bytes.clear();
+            entries.clear();
+        }
+    };
+
+    inline void set_sysex_payload(midi_event_t &event, std::string_view payload, sysex_heap &heap) {
+        event.flags |= MIDI_EVENT_PAYLOAD;
+        if (payload.size() <= sizeof(event.sysex)) {
+            event.data2 = 128u | payload.size();
+            event.sysex = 0;
+            memcpy(&event.sysex, payload.data(), payload.size());
+        } else {
+            event.data2 = 0;
+            event.sysex = heap.push(payload);
+        }
+    }
+
+    /*
+     * Sets the payload of a sysex event from the wire (see copy_sysex_payload).
+     */
+    template<typename R = skip_realtime>
+    void set_sysex_payload(midi_event_t &event, const uint8_t *begin, const uint8_t *end, sysex_heap &heap,
+                           R &&realtime = R{}) {
+        if (end - begin <= static_cast<ptrdiff_t>(sizeof(event.sysex))) {
+            char payload[sizeof(event.sysex)];
+            set_sysex_payload(event, {payload, copy_sysex_payload(begin, end, payload, realtime)}, heap);
+            return;
+        }
+        event.flags |= MIDI_EVENT_PAYLOAD;
+        event.data2 = 0;
+        event.sysex = heap.push(begin, end, realtime);
+        const auto e = heap.entries.back();
+        if (e.size <= sizeof(event.sysex)) {
+            // real-time bytes were skipped, the payload fits inline after all
+            char payload[sizeof(event.sysex)];
+            memcpy(payload, heap.bytes.data() + e.offset, e.size);
+            heap.bytes.resize(e.offset);
+            heap.entries.pop_back();
+            set_sysex_payload(event, {payload, e.size}, heap);
+        }
+    }
+
+    inline midi_event_t make_midi_event(const midi_message_t &message, sysex_heap &heap) {
+        midi_event_t event{};
+        event.status = message.status;
+        if (status_get_type(message.status) != SYSTEMMESSAGE) {
+            uint8_t data[2]{};
+            encode_channel_message_data(message, data);
+            event.data1 = data[0];
+            event.data2 = data[1];
+            return event;
+        }
+        const auto &system = std::get<system_message_t>(message.message);
+        switch (status_get_channel(message.status)) {
+            case SYSEX_MESSAGE: {
+                const auto &sysex = std::get<sysex_message_t>(system);
+                event.data1 = sysex.id;
+                set_sysex_payload(event, sysex.message, heap);
+                break;
+            }
+            case SONG_POSITION_POINTER: {
+                const auto &spp = std::get<song_position_pointer_t>(system);
+                event.data1 = spp.lsb();
+                event.data2 = spp.msb();
+                break;
+            }
+            case SONG_SELECT:
+                event.data1 = std::get<song_select_t>(system).song_select;
+                break;
+            default:
+                break;
+        }
+        return event;
+    }
+
+    inline void make_midi_message(const midi_event_t &event, const sysex_heap &heap, midi_message_t &message) {
+        if (event.is_sysex()) {
+            message.status = event.status;
+            message.message = system_message_t{sysex_message_t{event.data1, std::string(heap.get(event))}};
+            return;
+        }
+        const uint8_t data[2] = {event.data1, event.data2};
+        size_t length;
+        try_decode_midi_message_data(event.status, data, sizeof(data), message, length);
+    }
+
+    inline midi_message_t make_midi_message(const midi_event_t &event, const sysex_heap &heap) {
+        midi_message_t message;
+        make_midi_message(event, heap, message);
+        return message;
+    }
+
+    /*
+     * Decodes a single message straight into a midi_event_t. Sysex payloads are copied into `heap` (or stored inline)
+     * without an intermediate buffer. Real-time bytes inside a sysex message are passed to `realtime(uint8_t)`.
+     */
+    template<typename R = skip_realtime>
+    decode_status try_decode_midi_event(const uint8_t *data, size_t size, midi_event_t &event, sysex_heap &heap,
+                                        size_t &length, R &&realtime = R{}) {
+        if (size == 0) return DECODE_END_OF_INPUT;
+        const auto status = data[0];
+        if (!(status & 128u)) return DECODE_INVALID_STATUS;
+        if (status == make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE)) {
+            const auto end = find_sysex_end(data + 1, data + size);
+            if (end == data + size) return DECODE_NEED_MORE_DATA;
+            if (end == data + 1) return DECODE_EMPTY_SYSEX;
+            event = midi_event_t{status, data[1]};
+            set_sysex_payload(event, data + 2, end, heap, realtime);
+            length = end - data + 1;
+            return DECODE_OK;
+        }
+        length = 1 + status_data_length(status);
+        if (size < length) return DECODE_NEED_MORE_DATA;
+        event = midi_event_t{status, length > 1 ? data[1] : uint8_t{0}, length > 2 ? data[2] : uint8_t{0}};
+        return DECODE_OK;
+    }
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_EVENT_HPP
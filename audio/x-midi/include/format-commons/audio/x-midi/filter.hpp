@@ -0,0 +1,170 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_FILTER_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_FILTER_HPP
+
+#include <format-commons/audio/x-midi/messages.hpp>
+#include <format-commons/audio/x-midi/decoder.hpp>
+#include <format-commons/audio/x-midi/scan.hpp>
+
+#include <initializer_list>
+#include <type_traits>
+
+namespace format::audio::x_midi {
+
+    constexpr uint16_t channel_mask(unsigned channel) {
+        return 1u << (channel & 15u);
+    }
+
+    constexpr uint16_t kind_mask(status_kind kind) {
+        return 1u << kind;
+    }
+
+    constexpr uint16_t CHANNEL_MESSAGE_KINDS = kind_mask(STATUS_SYSEX) - 1u;
+
+    /*
+     * Runtime message filter for filtered_decoder: a channel mask (channel messages only), a mask of status_kind values
+     * and a set of accepted controller numbers (control changes only). Everything is accepted by default.
+     */
+    struct midi_filter_t {
+        uint16_t channels{0xffffu};
+        uint16_t kinds{0xffffu};
+        uint64_t controllers[2]{~uint64_t{0}, ~uint64_t{0}};
+
+        constexpr void set_controllers(std::initializer_list<uint8_t> accepted) {
+            controllers[0] = controllers[1] = 0;
+            for (const auto controller : accepted) {
+                controllers[controller >> 6u & 1u] |= uint64_t{1} << (controller & 63u);
+            }
+        }
+
+        constexpr bool operator()(uint8_t status, uint8_t data1) const {
+            const auto kind = status_table[status].kind;
+            if (!(kinds >> kind & 1u)) return false;
+            if (kind < STATUS_SYSEX && !(channels >> status_get_channel(status) & 1u)) return false;
+            if (kind == STATUS_CONTROL_CHANGE && !(controllers[data1 >> 6u & 1u] >> (data1 & 63u) & 1u)) return false;
+            return true;
+        }
+    };
+
+    /*
+     * Determines the length of the data bytes following status byte `status` without decoding them (see
+     * try_decode_midi_message_data). Real-time bytes inside a sysex message are still passed to `realtime(uint8_t)`.
+     */
+    template<typename R = skip_realtime>
+    decode_status skip_midi_message_data(uint8_t status, const uint8_t *data, size_t size, size_t &length,
+                                         R &&realtime = R{}) noexcept {
+        const auto &info = status_table[status];
+        if (info.kind == STATUS_NONE) return DECODE_INVALID_STATUS;
+        if (info.kind != STATUS_SYSEX) {
+            length = info.data_length;
+            return size < length ? DECODE_NEED_MORE_DATA : DECODE_OK;
+        }
+        const auto end = find_sysex_end(data, data + size);
+        if (end == data + size) return DECODE_NEED_MORE_DATA;
+        if (end == data) return DECODE_EMPTY_SYSEX;
+        if constexpr (!std::is_same_v<std::decay_t<R>, skip_realtime>) {
+            for_each_status_byte(data, end, [&realtime](const uint8_t *c) {
+                if (*c >= 0xf8u) realtime(*c);
+            });
+        }
+        length = end - data + 1;
+        return DECODE_OK;
+    }
+
+    /*
+     * Decoder that only decodes messages accepted by `filter(status, data1)` (data1 is the first data byte, the sysex
+     * id, or 0 for messages without data). Rejected messages are skipped by length; rejected sysex messages are never
+     * copied. Any callable works as a filter, e.g. a lambda for filters known at compile time, or midi_filter_t.
+     * Running status is supported like in running_status_decoder.
+     */
+    template<typename Filter = midi_filter_t>
+    struct filtered_decoder {
+        Filter filter;
+        running_status_decoder decoder{};
+        // number of messages skipped so far
+        size_t skipped{0};
+
+        explicit filtered_decoder(Filter f = Filter{}) : filter(std::move(f)) {}
+
+        /*
+         * Decodes the next accepted message. `length` is set to the number of bytes consumed, including skipped
+         * messages, even if no message could be decoded.
+         */
+        template<typename R = skip_realtime>
+        decode_status try_decode(const uint8_t *data, size_t size, midi_message_t &message, size_t &length,
+                                 R &&realtime = R{}) noexcept {
+            length = 0;
+            for (;;) {
+                const auto it = data + length;
+                const auto left = size - length;
+                if (left == 0) return DECODE_END_OF_INPUT;
+                auto status = it[0];
+                auto body = it + 1;
+                if (!(status & 128u)) {
+                    if (!decoder.running_status) return DECODE_INVALID_STATUS;
+                    status = decoder.running_status;
+                    body = it;
+                }
+                const auto available = it + left - body;
+                const auto has_data = status_table[status].data_length || status_table[status].kind == STATUS_SYSEX;
+                if (has_data && available == 0) return DECODE_NEED_MORE_DATA;
+                size_t message_length;
+                decode_status result;
+                const auto accepted = filter(status, has_data ? body[0] : uint8_t{0});
+                if (accepted) {
+                    result = try_decode_midi_message_data(status, body, available, message, message_length, realtime);
+                } else {
+                    result = skip_midi_message_data(status, body, available, message_length, realtime);
+                }
+                if (result != DECODE_OK) return result;
+                decoder.update(status);
+                length += body - it + message_length;
+                if (accepted) return DECODE_OK;
+                ++skipped;
+            }
+        }
+
+        /*
+         * Decodes up to `count` accepted messages into `out`; `consumed` includes skipped messages.
+         */
+        decode_batch_t decode(const uint8_t *data, size_t size, midi_message_t *out, size_t count) {
+            decode_batch_t result{};
+            while (result.count != count) {
+                size_t length = 0;
+                result.status = try_decode(data + result.consumed, size - result.consumed, out[result.count], length);
+                result.consumed += length;
+                if (result.status != DECODE_OK) return result;
+                ++result.count;
+            }
+            if (result.consumed == size) result.status = DECODE_END_OF_INPUT;
+            return result;
+        }
+
+        void reset() {
+            decoder.reset();
+        }
+    };
+
+    template<typename Filter>
+    filtered_decoder<Filter> make_filtered_decoder(Filter filter) {
+        return filtered_decoder<Filter>(std::move(filter));
+    }
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_FILTER_HPP
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_MERGE_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_MERGE_HPP
+
+#include <format-commons/audio/x-midi/event.hpp>
+#include <format-commons/audio/x-midi/smf.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace format::audio::x_midi {
+
+    /*
+     * Whether a split sysex message is still open after an event with `status`; `terminated` tells whether a sysex
+     * event ends with F7.
+     */
+    inline bool sysex_open_after(bool open, uint8_t status, bool terminated) {
+        if (status == 0xf0u) return !terminated;
+        // outside of a split sysex message, 0xF7 events are escaped bytes and leave the state alone
+        if (status == 0xf7u) return open && !terminated;
+        return false;
+    }
+
+    /*
+     * Source of midi_merge that reads a track of a Standard MIDI File on the fly.
+     * A sysex message can be split into a 0xF0 event without terminating F7 and 0xF7 continuation events; in_sysex()
+     * is true until the part with the terminating F7 has been read.
+     */
+    struct smf_track_source {
+        using event_type = smf_event_t;
+
+        smf_track_reader reader;
+        bool open_sysex{false};
+
+        explicit smf_track_source(smf_track_reader r) : reader(r) {}
+
+        bool next(smf_event_t &event) {
+            if (!reader.next(event)) return false;
+            const auto terminated = !event.data.empty() && static_cast<uint8_t>(event.data.back()) == 0b11110111;
+            open_sysex = sysex_open_after(open_sysex, event.event.status, terminated);
+            return true;
+        }
+
+        [[nodiscard]] bool in_sysex() const {
+            return open_sysex;
+        }
+    };
+
+    /*
+     * Source of midi_merge that reads already decoded events, e.g. a track decoded by decode_smf_track or events
+     * captured from an input port. Split sysex messages are tracked through the MIDI_EVENT_SYSEX_UNTERMINATED and
+     * MIDI_EVENT_SYSEX_TERMINATOR flags set by decode_smf_track, like smf_track_source does.
+     */
+    struct timed_event_source {
+        using event_type = smf_timed_event_t;
+
+        const smf_timed_event_t *it;
+        const smf_timed_event_t *end;
+        bool open_sysex{false};
+
+        timed_event_source(const smf_timed_event_t *data, size_t size) : it(data), end(data + size) {}
+
+        explicit timed_event_source(const std::vector<smf_timed_event_t> &events)
+                : timed_event_source(events.data(), events.size()) {}
+
+        bool next(smf_timed_event_t &event) {
+            if (it == end) return false;
+            event = *it++;
+            const auto flags = event.event.flags;
+            const auto terminated = event.event.status == 0xf0u ? !(flags & MIDI_EVENT_SYSEX_UNTERMINATED)
+                                                                : (flags & MIDI_EVENT_SYSEX_TERMINATOR) != 0;
+            open_sysex = sysex_open_after(open_sysex, event.event.status, terminated);
+            return true;
+        }
+
+        [[nodiscard]] bool in_sysex() const {
+            return open_sysex;
+        }
+    };
+
+    template<typename S, typename = void>
+    struct has_in_sysex : std::false_type {
+    };
+
+    template<typename S>
+    struct has_in_sysex<S, std::void_t<decltype(std::declval<const S &>().in_sysex())>> : std::true_type {
+    };
+
+    /*
+     * Merges sources whose events are ordered by `tick` into a single stream ordered by `tick` in O(log k) per event.
+     * Only the current event of every source is buffered. Events with the same tick are returned in the order of
+     * their sources, events of one source in their original order.
+     *
+     * A source is a type with `event_type` and `bool next(event_type &)`. If it has `bool in_sysex() const`, a source
+     * that is in the middle of a split sysex message is read exclusively until the message is complete, so no other
+     * event ends up inside it. Events of other sources that fall into such a message are delayed; their tick is raised
+     * to the tick of the last part so the result stays ordered.
+     */
+    template<typename Source>
+    struct midi_merge {
+        using event_type = typename Source::event_type;
+
+        struct entry_t {
+            event_type event;
+            size_t source;
+        };
+
+        static constexpr size_t none = std::numeric_limits<size_t>::max();
+
+        std::vector<Source> sources;
+        std::vector<entry_t> heap{};
+        size_t locked{none};
+        decltype(event_type::tick) tick{0};
+
+        explicit midi_merge(std::vector<Source> s) : sources(std::move(s)) {
+            heap.reserve(sources.size());
+            for (size_t i = 0; i < sources.size(); ++i) refill(i);
+        }
+
+        /*
+         * Reads the next event and the index of its source. Returns false when all sources are exhausted.
+         */
+        bool next(event_type &event, size_t &source) {
+            if (locked != none) {
+                source = locked;
+                const auto more = sources[source].next(event);
+                if (more) {
+                    tick = std::max(tick, event.tick);
+                    event.tick = tick;
+                    if (!in_sysex(sources[source])) {
+                        locked = none;
+                        refill(source);
+                    }
+                    return true;
+                }
+                // the source ended inside a sysex message
+                locked = none;
+            }
+            if (heap.empty()) return false;
+            std::pop_heap(heap.begin(), heap.end(), later);
+            event = heap.back().event;
+            source = heap.back().source;
+            heap.pop_back();
+            tick = std::max(tick, event.tick);
+            event.tick = tick;
+            if (in_sysex(sources[source])) {
+                locked = source;
+            } else {
+                refill(source);
+            }
+            return true;
+        }
+
+        bool next(event_type &event) {
+            size_t source;
+            return next(event, source);
+        }
+
+        static bool in_sysex(const Source &source) {
+            if constexpr (has_in_sysex<Source>::value) {
+                return source.in_sysex();
+            } else {
+                return false;
+            }
+        }
+
+        // heap order: the earliest event (lowest source index on ties) is on top
+        static bool later(const entry_t &a, const entry_t &b) {
+            if (a.event.tick != b.event.tick) return a.event.tick > b.event.tick;
+            return a.source > b.source;
+        }
+
+        void refill(size_t source) {
+            entry_t entry{{}, source};
+            if (!sources[source].next(entry.event)) return;
+            heap.push_back(entry);
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+    };
+
+    /*
+     * Merges all tracks of a file, e.g. to play back a format 1 file. Tracks are read on the fly.
+     */
+    inline midi_merge<smf_track_source> merge_smf_tracks(const smf_file &file) {
+        std::vector<smf_track_source> sources;
+        sources.reserve(file.tracks.size());
+        for (size_t i = 0; i < file.tracks.size(); ++i) sources.emplace_back(file.track(i));
+        return midi_merge<smf_track_source>(std::move(sources));
+    }
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_MERGE_HPP
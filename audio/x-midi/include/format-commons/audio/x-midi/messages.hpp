@@ -0,0 +1,231 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_MESSAGES_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_MESSAGES_HPP
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <variant>
+
+namespace format::audio::x_midi {
+
+    enum message_type_t {
+        NOTEOFF = 0b1000,
+        NOTEON,
+        POLYPHONICKEYPRESSURE,
+        CONTROLCHANGE,
+        PROGRAMCHANGE,
+        CHANNELPRESSURE,
+        PITCHWHEELCHANGE,
+        SYSTEMMESSAGE
+    };
+
+    enum system_common_message {
+        SYSEX_MESSAGE = 0b0000,
+        UNDEFINED_1,
+        SONG_POSITION_POINTER,
+        SONG_SELECT,
+        UNDEFINED_4,
+        UNDEFINED_5,
+        TUNE_REQUEST,
+        END_OF_EXCLUSIVE,
+        TIMING_CLOCK,
+        UNDEFINED_52,
+        START,
+        CONTINUE,
+        STOP,
+        UNDEFINED_13,
+        ACTIVE_SENSING,
+        RESET
+    };
+
+    constexpr auto make_status_byte(unsigned type, unsigned channel) {
+        return type << 4u | channel & 15u;
+    }
+
+    constexpr auto status_get_type(unsigned status_byte) {
+        return status_byte >> 4u;
+    }
+
+    constexpr auto status_get_channel(unsigned status_byte) {
+        return status_byte & 15u;
+    }
+
+    struct note_off_t {
+        uint8_t key{0};
+        uint8_t velocity{0};
+
+        note_off_t(uint8_t k, uint8_t v) : key(k), velocity(v) {}
+
+        note_off_t() = default;
+
+        bool operator==(const note_off_t &other) const {
+            return key == other.key && velocity == other.velocity;
+        }
+    };
+
+    struct note_on_t {
+        uint8_t key;
+        uint8_t velocity;
+
+        note_on_t(uint8_t k, uint8_t v) : key(k), velocity(v) {}
+
+        note_on_t() = default;
+
+        bool operator==(const note_on_t &other) const {
+            return key == other.key && velocity == other.velocity;
+        }
+    };
+
+    struct polyphonic_key_pressure_t {
+        uint8_t key;
+        uint8_t velocity;
+
+        polyphonic_key_pressure_t(uint8_t k, uint8_t v) : key(k), velocity(v) {}
+
+        polyphonic_key_pressure_t() = default;
+
+        bool operator==(const polyphonic_key_pressure_t &other) const {
+            return key == other.key && velocity == other.velocity;
+        }
+    };
+
+    struct control_change_t {
+        uint8_t controller;
+        uint8_t value;
+
+        control_change_t(uint8_t c, uint8_t v) : controller(c), value(v) {}
+
+        control_change_t() = default;
+
+        bool operator==(const control_change_t &other) const {
+            return controller == other.controller && value == other.value;
+        }
+    };
+
+    struct program_change_t {
+        uint8_t program_number;
+
+        explicit program_change_t(uint8_t p) : program_number(p) {}
+
+        program_change_t() = default;
+
+        bool operator==(const program_change_t &other) const {
+            return program_number == other.program_number;
+        }
+    };
+
+    struct channel_pressure_t {
+        uint8_t pressure;
+
+        explicit channel_pressure_t(uint8_t p) : pressure(p) {}
+
+        channel_pressure_t() = default;
+
+        bool operator==(const channel_pressure_t &other) const {
+            return pressure == other.pressure;
+        }
+    };
+
+    struct pitch_wheel_change_t {
+        uint16_t pitch_wheel;
+
+        explicit pitch_wheel_change_t(uint8_t l, uint8_t m) : pitch_wheel((m << 8u) | l) {}
+
+        pitch_wheel_change_t() = default;
+
+        bool operator==(const pitch_wheel_change_t &other) const {
+            return pitch_wheel == other.pitch_wheel;
+        }
+
+        [[nodiscard]] uint8_t lsb() const {
+            return pitch_wheel & 0xffu;
+        }
+
+        [[nodiscard]] uint8_t msb() const {
+            return pitch_wheel >> 8u;
+        }
+    };
+
+    struct song_position_pointer_t {
+        uint16_t song_position;
+
+        explicit song_position_pointer_t(uint8_t l, uint8_t m) : song_position((m << 8u) | l) {}
+
+        song_position_pointer_t() = default;
+
+        bool operator==(const song_position_pointer_t &other) const {
+            return song_position == other.song_position;
+        }
+
+        [[nodiscard]] uint8_t lsb() const {
+            return song_position & 0xffu;
+        }
+
+        [[nodiscard]] uint8_t msb() const {
+            return song_position >> 8u;
+        }
+    };
+
+    struct song_select_t {
+        uint8_t song_select;
+
+        explicit song_select_t(uint8_t s) : song_select(s) {}
+
+        song_select_t() = default;
+
+        bool operator==(const song_select_t &other) const {
+            return song_select == other.song_select;
+        }
+    };
+
+    struct sysex_message_t {
+        uint8_t id{0};
+        std::string message;
+
+        sysex_message_t(uint8_t id, std::string r) : id(id), message(std::move(r)) {}
+
+        sysex_message_t(std::initializer_list<uint8_t> l) : id(*l.begin()), message(l.begin() + 1, l.end()) {}
+
+        sysex_message_t() = default;
+
+        bool operator==(const sysex_message_t &other) const {
+            return id == other.id && message == other.message;
+        }
+    };
+
+    using system_message_t = std::variant<sysex_message_t, song_position_pointer_t, song_select_t, uint8_t>;
+
+    struct midi_message_t {
+        uint8_t status{};
+        std::variant<note_off_t, note_on_t, polyphonic_key_pressure_t, control_change_t, program_change_t, channel_pressure_t, pitch_wheel_change_t, system_message_t> message{};
+
+        template<typename T>
+        midi_message_t(uint8_t s, T &&v): status(s), message(std::forward<T>(v)) {}
+
+        midi_message_t() = default;
+
+        bool operator==(const midi_message_t &other) const {
+            return status == other.status && message == other.message;
+        }
+    };
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_MESSAGES_HPP
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_PARSER_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_PARSER_HPP
+
+#include <format-commons/audio/x-midi/messages.hpp>
+#include <format-commons/audio/x-midi/decoder.hpp>
+
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
+
+namespace format::audio::x_midi {
+
+    /*
+     * Part of a sysex message delivered by midi_stream_parser in fragment mode.
+     * `data` points into the buffer passed to feed() and is only valid during the callback.
+     * The terminating fragment has `last` set (and may be empty); `aborted` is set if the sysex message was interrupted by
+     * another status byte.
+     */
+    struct sysex_fragment_t {
+        uint8_t id;
+        std::string_view data;
+        bool first;
+        bool last;
+        bool aborted;
+    };
+
+    /*
+     * True if `Handler` declares `using sysex_fragments = std::true_type`.
+     */
+    template<typename Handler, typename = void>
+    struct wants_sysex_fragments : std::false_type {
+    };
+
+    template<typename Handler>
+    struct wants_sysex_fragments<Handler, std::void_t<typename Handler::sysex_fragments>>
+            : std::bool_constant<Handler::sysex_fragments::value> {
+    };
+
+    /*
+     * Resumable parser for byte streams that arrive in arbitrary chunks (e.g. USB or serial reads).
+     * feed() can be called with any number of bytes; every complete message is passed to `handler(const midi_message_t &)`.
+     *
+     * If `Handler` declares `using sysex_fragments = std::true_type`, sysex payloads are not collected but passed
+     * to `handler(const sysex_fragment_t &)` as fragments of at most `fragment_size` bytes as soon as they arrive, so
+     * memory use does not depend on the size of sysex messages.
+     *
+     * Running status is supported. Real-time messages are delivered as soon as they arrive, even in the middle of
+     * another message. Bytes that cannot be decoded (data bytes without status, empty sysex messages, sysex messages
+     * interrupted by another status byte) are dropped and counted in `dropped`.
+     */
+    template<typename Handler>
+    struct midi_stream_parser {
+        static constexpr bool fragmented = wants_sysex_fragments<Handler>::value;
+
+        Handler handler;
+        size_t fragment_size;
+        size_t dropped{0};
+
+        midi_message_t message{};
+        uint8_t status{0};
+        uint8_t pending[2]{};
+        size_t length{0};
+        bool in_sysex{false};
+        bool has_sysex_id{false};
+        uint8_t sysex_id{0};
+        bool sysex_started{false};
+
+        explicit midi_stream_parser(Handler h, size_t fragment = 256) : handler(std::move(h)), fragment_size(fragment) {}
+
+        void feed(const uint8_t *data, size_t size) {
+            const auto end = data + size;
+            for (auto it = data; it != end; ++it) {
+                const uint8_t c = *it;
+                if (c >= 0xf8u) {
+                    midi_message_t realtime(c, system_message_t{uint8_t{0}});
+                    handler(realtime);
+                } else if (c & 128u) {
+                    begin(c);
+                } else if (in_sysex) {
+                    // append the whole run of data bytes at once
+                    const auto run = find_status_byte(it, end);
+                    append_sysex(it, run);
+                    it = run - 1;
+                } else if (status) {
+                    pending[length++] = c;
+                    if (length == status_data_length(status)) complete();
+                } else {
+                    ++dropped;
+                }
+            }
+        }
+
+        void reset() {
+            status = 0;
+            length = 0;
+            in_sysex = false;
+            has_sysex_id = false;
+            sysex_started = false;
+        }
+
+        void begin(uint8_t c) {
+            if (in_sysex) {
+                in_sysex = false;
+                if (c == 0b11110111) {
+                    end_sysex(false);
+                    return;
+                }
+                end_sysex(true);
+            }
+            if (length) ++dropped;
+            length = 0;
+            status = c;
+            if (c == make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE)) {
+                in_sysex = true;
+                status = 0;
+                has_sysex_id = false;
+                sysex_started = false;
+                if constexpr (!fragmented) {
+                    message.status = c;
+                    auto *system = std::get_if<system_message_t>(&message.message);
+                    if (!system) system = &message.message.emplace<system_message_t>();
+                    if (!std::holds_alternative<sysex_message_t>(*system)) system->emplace<sysex_message_t>();
+                }
+            } else if (status_data_length(c) == 0) {
+                complete();
+            }
+        }
+
+        void append_sysex(const uint8_t *begin, const uint8_t *end) {
+            if (begin == end) return;
+            if (!has_sysex_id) {
+                has_sysex_id = true;
+                sysex_id = *begin++;
+                if constexpr (!fragmented) {
+                    std::get<sysex_message_t>(std::get<system_message_t>(message.message)).message.clear();
+                }
+            }
+            if constexpr (fragmented) {
+                while (begin != end) {
+                    const auto n = std::min<size_t>(end - begin, fragment_size);
+                    emit_fragment({reinterpret_cast<const char *>(begin), n}, false, false);
+                    begin += n;
+                }
+            } else {
+                auto &sysex = std::get<sysex_message_t>(std::get<system_message_t>(message.message));
+                sysex.message.append(reinterpret_cast<const char *>(begin), end - begin);
+            }
+        }
+
+        void end_sysex(bool aborted) {
+            if (!has_sysex_id || aborted) ++dropped;
+            if (!has_sysex_id) return;
+            if constexpr (fragmented) {
+                emit_fragment({}, true, aborted);
+            } else if (!aborted) {
+                std::get<sysex_message_t>(std::get<system_message_t>(message.message)).id = sysex_id;
+                handler(message);
+            }
+        }
+
+        void emit_fragment(std::string_view data, bool last, bool aborted) {
+            const sysex_fragment_t fragment{sysex_id, data, !sysex_started, last, aborted};
+            sysex_started = true;
+            handler(fragment);
+        }
+
+        void complete() {
+            size_t consumed;
+            try_decode_midi_message_data(status, pending, length, message, consumed);
+            handler(message);
+            length = 0;
+            // channel messages keep their status as running status, system common messages clear it
+            if (status >= 0xf0u) status = 0;
+        }
+    };
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_PARSER_HPP
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_RING_BUFFER_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_RING_BUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace format::audio::x_midi {
+
+    constexpr size_t cache_line_size = 64;
+
+    /*
+     * Bounded wait-free single-producer/single-consumer queue, e.g. for midi_event_t between a parser thread and a
+     * consumer thread. N has to be a power of two. Values are copied into preallocated slots, so passing trivially
+     * copyable types never allocates.
+     */
+    template<typename T, size_t N>
+    struct spsc_ring_buffer {
+        static_assert(N != 0 && (N & (N - 1)) == 0, "N has to be a power of two");
+
+        // written by the producer
+        alignas(cache_line_size) std::atomic<size_t> tail{0};
+        size_t cached_head{0};
+        // written by the consumer
+        alignas(cache_line_size) std::atomic<size_t> head{0};
+        size_t cached_tail{0};
+
+        alignas(cache_line_size) T slots[N]{};
+
+        template<typename V>
+        bool try_push(V &&value) {
+            const auto t = tail.load(std::memory_order_relaxed);
+            if (t - cached_head == N) {
+                cached_head = head.load(std::memory_order_acquire);
+                if (t - cached_head == N) return false;
+            }
+            slots[t & (N - 1)] = std::forward<V>(value);
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T &value) {
+            const auto h = head.load(std::memory_order_relaxed);
+            if (h == cached_tail) {
+                cached_tail = tail.load(std::memory_order_acquire);
+                if (h == cached_tail) return false;
+            }
+            value = std::move(slots[h & (N - 1)]);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        [[nodiscard]] size_t size() const {
+            return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+        }
+
+        [[nodiscard]] static constexpr size_t capacity() {
+            return N;
+        }
+    };
+
+    /*
+     * Bounded lock-free multi-producer/single-consumer queue, e.g. for merging several ports into one consumer.
+     * Producers claim slots with a compare-and-swap; the consumer is wait-free. N has to be a power of two.
+     */
+    template<typename T, size_t N>
+    struct mpsc_ring_buffer {
+        static_assert(N != 0 && (N & (N - 1)) == 0, "N has to be a power of two");
+
+        struct alignas(cache_line_size) cell_t {
+            std::atomic<size_t> sequence;
+            T value{};
+        };
+
+        // written by the producers
+        alignas(cache_line_size) std::atomic<size_t> tail{0};
+        // written by the consumer
+        alignas(cache_line_size) size_t head{0};
+
+        cell_t cells[N];
+
+        mpsc_ring_buffer() {
+            for (size_t i = 0; i < N; ++i) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        template<typename V>
+        bool try_push(V &&value) {
+            auto t = tail.load(std::memory_order_relaxed);
+            cell_t *cell;
+            for (;;) {
+                cell = &cells[t & (N - 1)];
+                const auto sequence = cell->sequence.load(std::memory_order_acquire);
+                const auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(t);
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)) break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    t = tail.load(std::memory_order_relaxed);
+                }
+            }
+            cell->value = std::forward<V>(value);
+            cell->sequence.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T &value) {
+            auto &cell = cells[head & (N - 1)];
+            if (cell.sequence.load(std::memory_order_acquire) != head + 1) return false;
+            value = std::move(cell.value);
+            cell.sequence.store(head + N, std::memory_order_release);
+            ++head;
+            return true;
+        }
+
+        [[nodiscard]] static constexpr size_t capacity() {
+            return N;
+        }
+    };
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_RING_BUFFER_HPP
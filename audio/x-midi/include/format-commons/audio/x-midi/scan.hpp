@@ -0,0 +1,216 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_SCAN_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_SCAN_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * The scanner uses AVX2 or SSE2 if the compiler targets them (e.g. -mavx2) and a portable word-at-a-time loop
+ * otherwise. Define FORMAT_COMMONS_AUDIO_X_MIDI_NO_SIMD to force the portable version.
+ */
+#if !defined(FORMAT_COMMONS_AUDIO_X_MIDI_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#elif !defined(FORMAT_COMMONS_AUDIO_X_MIDI_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace format::audio::x_midi {
+
+#if !defined(FORMAT_COMMONS_AUDIO_X_MIDI_NO_SIMD) && defined(__AVX2__)
+    constexpr size_t scan_block_size = 32;
+
+    /*
+     * Bit i is set if block[i] is a status byte (has the high bit set).
+     */
+    inline uint32_t status_byte_mask(const uint8_t *block) noexcept {
+        const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(v));
+    }
+
+    /*
+     * Bit i is set if block[i] == value.
+     */
+    inline uint32_t byte_mask(const uint8_t *block, uint8_t value) noexcept {
+        const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+        const auto eq = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(static_cast<char>(value)));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+    }
+#elif !defined(FORMAT_COMMONS_AUDIO_X_MIDI_NO_SIMD) && defined(__SSE2__)
+    constexpr size_t scan_block_size = 16;
+
+    inline uint32_t status_byte_mask(const uint8_t *block) noexcept {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+        return static_cast<uint32_t>(_mm_movemask_epi8(v));
+    }
+
+    inline uint32_t byte_mask(const uint8_t *block, uint8_t value) noexcept {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+        const auto eq = _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(value)));
+        return static_cast<uint32_t>(_mm_movemask_epi8(eq));
+    }
+#else
+    constexpr size_t scan_block_size = 8;
+
+    inline uint32_t status_byte_mask(const uint8_t *block) noexcept {
+        uint64_t word;
+        memcpy(&word, block, sizeof(word));
+        // most blocks contain data bytes only
+        if (!(word & 0x8080808080808080u)) return 0;
+        uint32_t mask = 0;
+        for (size_t i = 0; i < scan_block_size; ++i) mask |= uint32_t{block[i] >= 0x80u} << i;
+        return mask;
+    }
+
+    inline uint32_t byte_mask(const uint8_t *block, uint8_t value) noexcept {
+        uint64_t word;
+        memcpy(&word, block, sizeof(word));
+        // has-zero-byte test on word ^ value
+        const auto x = word ^ (0x0101010101010101u * value);
+        if (!((x - 0x0101010101010101u) & ~x & 0x8080808080808080u)) return 0;
+        uint32_t mask = 0;
+        for (size_t i = 0; i < scan_block_size; ++i) mask |= uint32_t{block[i] == value} << i;
+        return mask;
+    }
+#endif
+
+    /*
+     * Calls `f(const uint8_t *block, uint32_t mask)` for every block of [begin, end) with a non-zero `m(block)`.
+     * The last partial block is copied to a zero-filled buffer first; zero is neither a status byte nor 0xF7.
+     * Stops early and returns the position reported by `f` once it returns something other than nullptr.
+     */
+    template<typename M, typename F>
+    const uint8_t *scan_blocks(const uint8_t *begin, const uint8_t *end, M &&m, F &&f) {
+        auto it = begin;
+        for (; static_cast<size_t>(end - it) >= scan_block_size; it += scan_block_size) {
+            if (const auto mask = m(it)) {
+                if (const auto found = f(it, mask)) return found;
+            }
+        }
+        if (it != end) {
+            uint8_t tail[scan_block_size]{};
+            memcpy(tail, it, end - it);
+            if (const auto mask = m(tail)) {
+                if (const auto found = f(it, mask)) return found;
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+     * Returns the first status byte in [begin, end), or end.
+     */
+    inline const uint8_t *find_status_byte(const uint8_t *begin, const uint8_t *end) noexcept {
+        const auto found = scan_blocks(begin, end, status_byte_mask, [](const uint8_t *at, uint32_t mask) {
+            return at + __builtin_ctz(mask);
+        });
+        return found ? found : end;
+    }
+
+    /*
+     * Returns the first sysex terminator (0xF7) in [begin, end), or end.
+     */
+    inline const uint8_t *find_sysex_end(const uint8_t *begin, const uint8_t *end) noexcept {
+        const auto found = scan_blocks(begin, end, [](const uint8_t *block) {
+            return byte_mask(block, 0b11110111);
+        }, [](const uint8_t *at, uint32_t mask) {
+            return at + __builtin_ctz(mask);
+        });
+        return found ? found : end;
+    }
+
+    /*
+     * Calls `f(const uint8_t *position)` for every status byte in [begin, end), in order.
+     */
+    template<typename F>
+    void for_each_status_byte(const uint8_t *begin, const uint8_t *end, F &&f) {
+        scan_blocks(begin, end, status_byte_mask, [&f](const uint8_t *at, uint32_t mask) {
+            for (; mask; mask &= mask - 1) f(at + __builtin_ctz(mask));
+            return static_cast<const uint8_t *>(nullptr);
+        });
+    }
+
+    /*
+     * Sysex message found by midi_scanner. `end` is one past the terminating F7, or the position of the status byte
+     * that interrupted the message (`terminated` is false then).
+     */
+    struct sysex_extent_t {
+        size_t begin;
+        size_t end;
+        bool terminated;
+
+        bool operator==(const sysex_extent_t &other) const {
+            return begin == other.begin && end == other.end && terminated == other.terminated;
+        }
+    };
+
+    /*
+     * Classifies raw MIDI bytes without decoding them: positions of message boundaries (status bytes that start a
+     * message, including 0xF0), real-time bytes (also inside sysex messages) and sysex extents. Only status bytes are
+     * looked at, so data bytes are skipped a whole block at a time.
+     * scan() can be called repeatedly with consecutive chunks of a stream; positions count from the start of the
+     * stream.
+     */
+    struct midi_scanner {
+        std::vector<size_t> boundaries{};
+        std::vector<size_t> realtime{};
+        std::vector<sysex_extent_t> sysex{};
+
+        size_t offset{0};
+        bool in_sysex{false};
+        size_t sysex_begin{0};
+
+        void scan(const uint8_t *data, size_t size) {
+            for_each_status_byte(data, data + size, [this, data](const uint8_t *at) {
+                const auto position = offset + (at - data);
+                const auto c = *at;
+                if (c >= 0xf8u) {
+                    realtime.push_back(position);
+                    return;
+                }
+                if (in_sysex) {
+                    in_sysex = false;
+                    if (c == 0b11110111) {
+                        sysex.push_back({sysex_begin, position + 1, true});
+                        return;
+                    }
+                    sysex.push_back({sysex_begin, position, false});
+                }
+                boundaries.push_back(position);
+                if (c == 0xf0u) {
+                    in_sysex = true;
+                    sysex_begin = position;
+                }
+            });
+            offset += size;
+        }
+
+        void clear() {
+            boundaries.clear();
+            realtime.clear();
+            sysex.clear();
+            offset = 0;
+            in_sysex = false;
+        }
+    };
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_SCAN_HPP
@@ -0,0 +1,609 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_SMF_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_SMF_HPP
+
+#include <format-commons/audio/x-midi/messages.hpp>
+#include <format-commons/audio/x-midi/decoder.hpp>
+#include <format-commons/audio/x-midi/event.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <numeric>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace format::audio::x_midi {
+
+    struct invalid_smf_file : public std::exception {
+    };
+
+    /*
+     * Thrown by smf_writer for a delta time or length that cannot be stored as a variable-length quantity, or for an
+     * event written before the previous event of the track.
+     */
+    struct invalid_smf_value : public std::exception {
+    };
+
+    enum smf_meta_type {
+        META_SEQUENCE_NUMBER = 0x00,
+        META_TEXT = 0x01,
+        META_COPYRIGHT_NOTICE = 0x02,
+        META_TRACK_NAME = 0x03,
+        META_INSTRUMENT_NAME = 0x04,
+        META_LYRIC = 0x05,
+        META_MARKER = 0x06,
+        META_CUE_POINT = 0x07,
+        META_CHANNEL_PREFIX = 0x20,
+        META_END_OF_TRACK = 0x2f,
+        META_SET_TEMPO = 0x51,
+        META_SMPTE_OFFSET = 0x54,
+        META_TIME_SIGNATURE = 0x58,
+        META_KEY_SIGNATURE = 0x59,
+        META_SEQUENCER_SPECIFIC = 0x7f
+    };
+
+    constexpr uint8_t SMF_META_EVENT = 0xff;
+    constexpr uint32_t SMF_MAX_VLQ = 0x0fffffff;
+
+    /*
+     * Reads a variable-length quantity (at most four bytes). Returns false if the input ends early or the value is
+     * longer than four bytes.
+     */
+    inline bool read_vlq(const uint8_t *&it, const uint8_t *end, uint32_t &value) {
+        value = 0;
+        for (int i = 0; i < 4 && it != end; ++i) {
+            const auto c = *it++;
+            value = value << 7u | (c & 127u);
+            if (!(c & 128u)) return true;
+        }
+        return false;
+    }
+
+    /*
+     * Writes a variable-length quantity to `out`. Returns the number of bytes written (at most four).
+     * Throws invalid_smf_value if `value` is larger than SMF_MAX_VLQ.
+     */
+    inline size_t write_vlq(uint32_t value, uint8_t *out) {
+        if (value > SMF_MAX_VLQ) throw invalid_smf_value{};
+        uint8_t buffer[4];
+        size_t length = 0;
+        do {
+            buffer[length++] = value & 127u;
+            value >>= 7u;
+        } while (value);
+        for (size_t i = 0; i < length; ++i) {
+            out[i] = buffer[length - 1 - i] | (i + 1 < length ? 128u : 0u);
+        }
+        return length;
+    }
+
+    inline uint32_t read_be(const uint8_t *data, size_t size) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < size; ++i) {
+            value = value << 8u | data[i];
+        }
+        return value;
+    }
+
+    inline void write_be(uint32_t value, uint8_t *out, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            out[size - 1 - i] = value >> (8u * i) & 0xffu;
+        }
+    }
+
+    /*
+     * Read-only memory mapping of a file.
+     */
+    struct mapped_file {
+        const uint8_t *data{nullptr};
+        size_t size{0};
+
+        explicit mapped_file(const char *path) {
+            const auto fd = open(path, O_RDONLY);
+            if (fd < 0) throw std::system_error(errno, std::generic_category());
+            struct stat st{};
+            if (fstat(fd, &st) < 0) {
+                const auto e = errno;
+                close(fd);
+                throw std::system_error(e, std::generic_category());
+            }
+            size = st.st_size;
+            if (size) {
+                auto p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p == MAP_FAILED) {
+                    const auto e = errno;
+                    close(fd);
+                    throw std::system_error(e, std::generic_category());
+                }
+                data = static_cast<const uint8_t *>(p);
+            }
+            close(fd);
+        }
+
+        mapped_file(const mapped_file &) = delete;
+
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        mapped_file(mapped_file &&other) noexcept : data(std::exchange(other.data, nullptr)),
+                                                    size(std::exchange(other.size, 0)) {}
+
+        ~mapped_file() {
+            if (data) munmap(const_cast<uint8_t *>(data), size);
+        }
+    };
+
+    /*
+     * Event of a track. Channel messages are stored in `event` (status and data bytes). For sysex events (status 0xF0
+     * or 0xF7) and meta events (status 0xFF, type in `meta_type`), `data` points to the payload inside the file.
+     */
+    struct smf_event_t {
+        uint32_t delta{0};
+        uint64_t tick{0};
+        midi_event_t event{};
+        uint8_t meta_type{0};
+        std::string_view data{};
+
+        [[nodiscard]] bool is_meta() const {
+            return event.status == SMF_META_EVENT;
+        }
+
+        [[nodiscard]] bool is_sysex() const {
+            return event.status == 0xf0u || event.status == 0xf7u;
+        }
+
+        /*
+         * Decodes the event body like MidiMessage does, but with the buffer decoder instead of the grammar, so this
+         * header does not need format.hpp. Not available for meta events and sysex continuation events.
+         */
+        decode_status message(midi_message_t &message) const {
+            size_t length;
+            if (is_sysex()) {
+                if (event.status != 0xf0u) return DECODE_INVALID_STATUS;
+                return try_decode_midi_message_data(event.status, reinterpret_cast<const uint8_t *>(data.data()),
+                                                    data.size(), message, length);
+            }
+            if (is_meta()) return DECODE_INVALID_STATUS;
+            const uint8_t body[2] = {event.data1, event.data2};
+            return try_decode_midi_message_data(event.status, body, sizeof(body), message, length);
+        }
+    };
+
+    /*
+     * Iterates over the events of a single MTrk chunk. Supports running status; sysex and meta events cancel it.
+     */
+    struct smf_track_reader {
+        const uint8_t *it;
+        const uint8_t *end;
+        uint8_t running_status{0};
+        uint64_t tick{0};
+
+        smf_track_reader(const uint8_t *data, size_t size) : it(data), end(data + size) {}
+
+        explicit smf_track_reader(std::string_view track)
+                : smf_track_reader(reinterpret_cast<const uint8_t *>(track.data()), track.size()) {}
+
+        /*
+         * Reads the next event. Returns false at the end of the track (after META_END_OF_TRACK or at the end of the
+         * chunk). Throws invalid_smf_file on malformed input.
+         */
+        bool next(smf_event_t &event) {
+            if (it == end) return false;
+            if (!read_vlq(it, end, event.delta) || it == end) throw invalid_smf_file{};
+            tick += event.delta;
+            event.tick = tick;
+            event.meta_type = 0;
+            event.data = {};
+            auto status = *it;
+            if (status & 128u) {
+                ++it;
+            } else if (running_status) {
+                status = running_status;
+            } else {
+                throw invalid_smf_file{};
+            }
+            event.event = midi_event_t{status};
+            if (status == SMF_META_EVENT) {
+                running_status = 0;
+                if (it == end) throw invalid_smf_file{};
+                event.meta_type = *it++;
+                read_payload(event);
+                if (event.meta_type == META_END_OF_TRACK) it = end;
+            } else if (status == 0xf0u || status == 0xf7u) {
+                running_status = 0;
+                read_payload(event);
+            } else if (status < 0xf0u) {
+                running_status = status;
+                const auto length = status_data_length(status);
+                if (static_cast<size_t>(end - it) < length) throw invalid_smf_file{};
+                event.event.data1 = it[0];
+                if (length == 2) event.event.data2 = it[1];
+                it += length;
+            } else {
+                // system common and real-time messages cannot appear in a file
+                throw invalid_smf_file{};
+            }
+            return true;
+        }
+
+        void read_payload(smf_event_t &event) {
+            uint32_t length;
+            if (!read_vlq(it, end, length) || static_cast<size_t>(end - it) < length) throw invalid_smf_file{};
+            event.data = {reinterpret_cast<const char *>(it), length};
+            it += length;
+        }
+    };
+
+    /*
+     * Standard MIDI File (format 0, 1 or 2) on top of a buffer, e.g. a mapped_file. Track data is not copied; `tracks`
+     * point into the buffer.
+     */
+    struct smf_file {
+        uint16_t format{0};
+        uint16_t division{0};
+        std::vector<std::string_view> tracks{};
+
+        smf_file(const uint8_t *data, size_t size) {
+            const auto end = data + size;
+            if (size < 14 || memcmp(data, "MThd", 4) != 0) throw invalid_smf_file{};
+            const auto header_length = read_be(data + 4, 4);
+            if (header_length < 6 || static_cast<size_t>(end - data - 8) < header_length) throw invalid_smf_file{};
+            format = read_be(data + 8, 2);
+            const auto track_count = read_be(data + 10, 2);
+            division = read_be(data + 12, 2);
+            tracks.reserve(track_count);
+            for (auto it = data + 8 + header_length; end - it >= 8;) {
+                const auto length = read_be(it + 4, 4);
+                if (static_cast<size_t>(end - it - 8) < length) throw invalid_smf_file{};
+                // unknown chunks are skipped
+                if (memcmp(it, "MTrk", 4) == 0) tracks.emplace_back(reinterpret_cast<const char *>(it + 8), length);
+                it += 8 + length;
+            }
+            if (tracks.size() != track_count) throw invalid_smf_file{};
+        }
+
+        explicit smf_file(const mapped_file &file) : smf_file(file.data, file.size) {}
+
+        [[nodiscard]] smf_track_reader track(size_t index) const {
+            return smf_track_reader(tracks[index]);
+        }
+    };
+
+    /*
+     * Event of a decoded track: absolute tick and compact event. Meta events have status SMF_META_EVENT and their type
+     * in data1; sysex, sysex continuation and meta payloads are stored like sysex payloads of midi_event_t.
+     */
+    struct smf_timed_event_t {
+        uint64_t tick;
+        midi_event_t event;
+
+        bool operator==(const smf_timed_event_t &other) const {
+            return tick == other.tick && event == other.event;
+        }
+
+        bool operator!=(const smf_timed_event_t &other) const {
+            return !(*this == other);
+        }
+    };
+
+    static_assert(sizeof(smf_timed_event_t) == 16);
+
+    /*
+     * All events of a track in a flat array. Payloads longer than four bytes are stored in `heap`.
+     */
+    struct smf_track_events {
+        std::vector<smf_timed_event_t> events{};
+        sysex_heap heap{};
+
+        [[nodiscard]] std::string_view payload(const smf_timed_event_t &event) const {
+            return heap.get(event.event);
+        }
+    };
+
+    /*
+     * Decodes a whole track into `out` (which is cleared first). Throws invalid_smf_file on malformed input.
+     */
+    inline void decode_smf_track(std::string_view track, smf_track_events &out) {
+        out.events.clear();
+        out.heap.clear();
+        // typical channel messages take three bytes (delta and two data bytes with running status)
+        out.events.reserve(track.size() / 3);
+        smf_track_reader reader(track);
+        smf_event_t event;
+        while (reader.next(event)) {
+            auto compact = event.event;
+            const auto begin = reinterpret_cast<const uint8_t *>(event.data.data());
+            const auto end = begin + event.data.size();
+            if (event.is_meta()) {
+                compact.data1 = event.meta_type;
+                set_sysex_payload(compact, event.data, out.heap);
+            } else if (compact.status == 0xf0u) {
+                // like MidiMessage: the first byte is the id, the payload ends at F7
+                if (begin == end || (*begin & 128u)) throw invalid_smf_file{};
+                compact.data1 = *begin;
+                const auto sysex_end = find_sysex_end(begin + 1, end);
+                if (sysex_end == end) compact.flags |= MIDI_EVENT_SYSEX_UNTERMINATED;
+                set_sysex_payload(compact, begin + 1, sysex_end, out.heap);
+            } else if (compact.status == 0xf7u) {
+                // continuation or escaped bytes are kept as they are
+                if (begin != end && end[-1] == 0b11110111) compact.flags |= MIDI_EVENT_SYSEX_TERMINATOR;
+                set_sysex_payload(compact, event.data, out.heap);
+            }
+            out.events.push_back({event.tick, compact});
+        }
+    }
+
+    inline smf_track_events decode_smf_track(std::string_view track) {
+        smf_track_events out;
+        decode_smf_track(track, out);
+        return out;
+    }
+
+    /*
+     * Decodes all tracks of a file on up to `threads` threads. Tracks are independent, so every track is decoded by a
+     * single thread exactly like decode_smf_track() would; the result does not depend on the number of threads.
+     * Larger tracks are started first. If any track is malformed, its exception is rethrown after all threads have
+     * finished. If a thread cannot be started, the remaining work is done by the threads that are already running.
+     */
+    inline std::vector<smf_track_events> decode_smf_tracks(const smf_file &file,
+                                                           unsigned threads = std::thread::hardware_concurrency()) {
+        const auto count = file.tracks.size();
+        std::vector<smf_track_events> result(count);
+        std::vector<std::exception_ptr> errors(count);
+
+        std::vector<size_t> order(count);
+        std::iota(order.begin(), order.end(), size_t{0});
+        std::stable_sort(order.begin(), order.end(), [&file](size_t a, size_t b) {
+            return file.tracks[a].size() > file.tracks[b].size();
+        });
+
+        std::atomic<size_t> next{0};
+        auto work = [&]() {
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+                const auto track = order[i];
+                try {
+                    decode_smf_track(file.tracks[track], result[track]);
+                } catch (...) {
+                    errors[track] = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        const auto thread_count = std::min<size_t>(std::max(threads, 1u), count);
+        // reserved up front, so only the thread constructor can throw below
+        if (thread_count > 1) workers.reserve(thread_count - 1);
+        for (size_t i = 1; i < thread_count; ++i) {
+            try {
+                workers.emplace_back(work);
+            } catch (const std::system_error &) {
+                break;
+            }
+        }
+        work();
+        for (auto &worker : workers) worker.join();
+
+        for (const auto &error : errors) {
+            if (error) std::rethrow_exception(error);
+        }
+        return result;
+    }
+
+    /*
+     * Output of smf_writer that keeps the whole file in memory.
+     */
+    struct smf_buffer_sink {
+        std::vector<uint8_t> buffer{};
+
+        void write(const uint8_t *data, size_t size) {
+            buffer.insert(buffer.end(), data, data + size);
+        }
+
+        void patch(size_t offset, const uint8_t *data, size_t size) {
+            memcpy(buffer.data() + offset, data, size);
+        }
+
+        [[nodiscard]] size_t tell() const {
+            return buffer.size();
+        }
+
+        void flush() {}
+    };
+
+    /*
+     * Output of smf_writer that writes to a file descriptor through a fixed-size buffer. Writes of at least `capacity`
+     * bytes bypass the buffer, so it never grows beyond `capacity`.
+     * Already written data is patched with pwrite, so the file descriptor has to be seekable.
+     */
+    struct smf_fd_sink {
+        int fd;
+        size_t capacity;
+        size_t flushed{0};
+        std::vector<uint8_t> buffer{};
+
+        explicit smf_fd_sink(int f, size_t c = 65536) : fd(f), capacity(c) {
+            buffer.reserve(capacity);
+        }
+
+        void write(const uint8_t *data, size_t size) {
+            if (buffer.size() + size > capacity) flush();
+            if (size >= capacity) {
+                write_all(data, size);
+                flushed += size;
+                return;
+            }
+            buffer.insert(buffer.end(), data, data + size);
+        }
+
+        void patch(size_t offset, const uint8_t *data, size_t size) {
+            if (offset < flushed) {
+                const auto n = std::min(size, flushed - offset);
+                if (pwrite(fd, data, n, offset) != static_cast<ssize_t>(n)) {
+                    throw std::system_error(errno, std::generic_category());
+                }
+                offset += n;
+                data += n;
+                size -= n;
+            }
+            if (size) memcpy(buffer.data() + (offset - flushed), data, size);
+        }
+
+        [[nodiscard]] size_t tell() const {
+            return flushed + buffer.size();
+        }
+
+        void flush() {
+            write_all(buffer.data(), buffer.size());
+            flushed += buffer.size();
+            buffer.clear();
+        }
+
+        void write_all(const uint8_t *data, size_t size) const {
+            for (size_t done = 0; done < size;) {
+                const auto n = ::write(fd, data + done, size - done);
+                if (n < 0) throw std::system_error(errno, std::generic_category());
+                done += n;
+            }
+        }
+    };
+
+    /*
+     * Streaming writer for Standard MIDI Files (format 0 or 1). Events are written with running status as they come in;
+     * track lengths and the track count are patched when a track ends, so tracks are never buffered as a whole.
+     *
+     * System common and real-time messages cannot be stored in a file; they are skipped, but their delta time is kept.
+     *
+     * Every begin_track() has to be matched by end_track(), otherwise the track length stays zero; finish() ends a
+     * track that is still open. Delta times and lengths above SMF_MAX_VLQ throw invalid_smf_value.
+     */
+    template<typename Sink>
+    struct smf_writer {
+        Sink sink;
+        running_status_encoder encoder{};
+        uint16_t track_count{0};
+        size_t track_start{0};
+        uint64_t tick{0};
+        uint32_t pending_delta{0};
+        bool track_open{false};
+
+        smf_writer(Sink s, uint16_t format, uint16_t division) : sink(std::move(s)) {
+            uint8_t header[14] = {'M', 'T', 'h', 'd', 0, 0, 0, 6};
+            write_be(format, header + 8, 2);
+            write_be(0, header + 10, 2);
+            write_be(division, header + 12, 2);
+            sink.write(header, sizeof(header));
+        }
+
+        void begin_track() {
+            const uint8_t header[8] = {'M', 'T', 'r', 'k', 0, 0, 0, 0};
+            track_start = sink.tell();
+            sink.write(header, sizeof(header));
+            encoder.reset();
+            tick = 0;
+            pending_delta = 0;
+            track_open = true;
+        }
+
+        void write(uint32_t delta, const midi_message_t &message) {
+            const auto type = status_get_type(message.status);
+            if (type == SYSTEMMESSAGE && status_get_channel(message.status) != SYSEX_MESSAGE) {
+                if (delta > SMF_MAX_VLQ - pending_delta) throw invalid_smf_value{};
+                pending_delta += delta;
+                tick += delta;
+                return;
+            }
+            if (type == SYSTEMMESSAGE) {
+                const auto &sysex = std::get<sysex_message_t>(std::get<system_message_t>(message.message));
+                if (sysex.message.size() > SMF_MAX_VLQ - 2) throw invalid_smf_value{};
+                write_delta(delta);
+                encoder.reset();
+                uint8_t header[6] = {0xf0};
+                auto length = 1 + write_vlq(2 + sysex.message.size(), header + 1);
+                header[length++] = sysex.id;
+                sink.write(header, length);
+                sink.write(reinterpret_cast<const uint8_t *>(sysex.message.data()), sysex.message.size());
+                const uint8_t eox = 0b11110111;
+                sink.write(&eox, 1);
+                return;
+            }
+            write_delta(delta);
+            uint8_t data[3] = {message.status};
+            const auto omit = encoder.omit_status(message.status);
+            const auto length = encode_channel_message_data(message, data + 1);
+            sink.write(data + omit, length + 1 - omit);
+        }
+
+        /*
+         * Writes an event at absolute tick `at`. Throws invalid_smf_value if `at` is before the previous event of the
+         * track or too far after it.
+         */
+        void write_at(uint64_t at, const midi_message_t &message) {
+            if (at < tick || at - tick > SMF_MAX_VLQ) throw invalid_smf_value{};
+            write(static_cast<uint32_t>(at - tick), message);
+        }
+
+        void write_meta(uint32_t delta, uint8_t type, std::string_view data) {
+            if (data.size() > SMF_MAX_VLQ) throw invalid_smf_value{};
+            write_delta(delta);
+            encoder.reset();
+            uint8_t header[6] = {SMF_META_EVENT, type};
+            const auto length = 2 + write_vlq(data.size(), header + 2);
+            sink.write(header, length);
+            sink.write(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+        }
+
+        /*
+         * Writes META_END_OF_TRACK and patches the track length and the track count.
+         */
+        void end_track(uint32_t delta = 0) {
+            write_meta(delta, META_END_OF_TRACK, {});
+            uint8_t length[4];
+            write_be(sink.tell() - track_start - 8, length, 4);
+            sink.patch(track_start + 4, length, 4);
+            uint8_t count[2];
+            write_be(++track_count, count, 2);
+            sink.patch(10, count, 2);
+            track_open = false;
+        }
+
+        void finish() {
+            if (track_open) end_track();
+            sink.flush();
+        }
+
+        void write_delta(uint32_t delta) {
+            if (delta > SMF_MAX_VLQ - pending_delta) throw invalid_smf_value{};
+            tick += delta;
+            uint8_t data[4];
+            sink.write(data, write_vlq(pending_delta + delta, data));
+            pending_delta = 0;
+        }
+    };
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_SMF_HPP
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_SPANS_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_SPANS_HPP
+
+#include <format-commons/audio/x-midi/messages.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+namespace format::audio::x_midi {
+
+    /*
+     * Notes in columns: note i started at start[i] and ended at end[i], and so on. Notes are stored in the order of
+     * their note-on.
+     */
+    struct note_spans_t {
+        std::vector<uint64_t> start{};
+        std::vector<uint64_t> end{};
+        std::vector<uint8_t> key{};
+        std::vector<uint8_t> velocity{};
+        std::vector<uint8_t> channel{};
+
+        [[nodiscard]] size_t size() const {
+            return start.size();
+        }
+
+        void reserve(size_t count) {
+            start.reserve(count);
+            end.reserve(count);
+            key.reserve(count);
+            velocity.reserve(count);
+            channel.reserve(count);
+        }
+
+        void clear() {
+            start.clear();
+            end.clear();
+            key.clear();
+            velocity.clear();
+            channel.clear();
+        }
+    };
+
+    /*
+     * Which note-on a note-off ends if the same key was struck several times on a channel.
+     */
+    enum note_overlap_policy {
+        // the oldest note
+        NOTE_OVERLAP_FIFO,
+        // the most recent note
+        NOTE_OVERLAP_LIFO
+    };
+
+    /*
+     * Pairs note-ons with note-offs (or note-ons with velocity 0) of the same channel and key in a single pass and
+     * writes the notes to `spans`. Ticks have to be non-decreasing. Note-offs without a sounding note are counted in
+     * `unmatched`; notes still sounding at the end are closed by finish().
+     */
+    struct note_span_extractor {
+        static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+        note_overlap_policy policy;
+        note_spans_t spans{};
+        size_t unmatched{0};
+
+        // sounding notes of every channel and key: a list through `next`, linked from head to tail
+        uint32_t head[16 * 128];
+        uint32_t tail[16 * 128];
+        std::vector<uint32_t> next{};
+        size_t open{0};
+
+        explicit note_span_extractor(note_overlap_policy p = NOTE_OVERLAP_FIFO) : policy(p) {
+            std::fill(std::begin(head), std::end(head), none);
+            std::fill(std::begin(tail), std::end(tail), none);
+        }
+
+        void note_on(uint64_t tick, uint8_t channel, uint8_t key, uint8_t velocity) {
+            if (velocity == 0) {
+                note_off(tick, channel, key);
+                return;
+            }
+            const auto slot = (channel & 15u) << 7u | (key & 127u);
+            const auto index = static_cast<uint32_t>(spans.size());
+            spans.start.push_back(tick);
+            spans.end.push_back(tick);
+            spans.key.push_back(key & 127u);
+            spans.velocity.push_back(velocity);
+            spans.channel.push_back(channel & 15u);
+            next.push_back(none);
+            ++open;
+            if (head[slot] == none) {
+                head[slot] = tail[slot] = index;
+            } else if (policy == NOTE_OVERLAP_FIFO) {
+                next[tail[slot]] = index;
+                tail[slot] = index;
+            } else {
+                next[index] = head[slot];
+                head[slot] = index;
+            }
+        }
+
+        void note_off(uint64_t tick, uint8_t channel, uint8_t key) {
+            const auto slot = (channel & 15u) << 7u | (key & 127u);
+            const auto index = head[slot];
+            if (index == none) {
+                ++unmatched;
+                return;
+            }
+            spans.end[index] = tick;
+            head[slot] = next[index];
+            if (head[slot] == none) tail[slot] = none;
+            --open;
+        }
+
+        void apply(uint64_t tick, uint8_t status, uint8_t data1, uint8_t data2) {
+            switch (status_get_type(status)) {
+                case NOTEON:
+                    note_on(tick, status_get_channel(status), data1, data2);
+                    break;
+                case NOTEOFF:
+                    note_off(tick, status_get_channel(status), data1);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        /*
+         * Applies all events in [begin, end) (e.g. smf_timed_event_t).
+         */
+        template<typename It>
+        void apply(It begin, It end) {
+            for (; begin != end; ++begin) {
+                const auto &event = begin->event;
+                apply(begin->tick, event.status, event.data1, event.data2);
+            }
+        }
+
+        /*
+         * Ends all sounding notes at `tick`.
+         */
+        void finish(uint64_t tick) {
+            if (open == 0) return;
+            for (size_t slot = 0; slot < 16 * 128; ++slot) {
+                for (auto index = head[slot]; index != none; index = next[index]) spans.end[index] = tick;
+                head[slot] = tail[slot] = none;
+            }
+            open = 0;
+        }
+
+        void clear() {
+            finish(0);
+            spans.clear();
+            next.clear();
+            unmatched = 0;
+        }
+    };
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_SPANS_HPP
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_HPP
+#define FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_HPP
+
+#include <format-commons/audio/x-midi/messages.hpp>
+#include <format-commons/audio/x-midi/decoder.hpp>
+#include <format-commons/audio/x-midi/scan.hpp>
+
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace format::audio::x_midi {
+
+    /*
+     * Calls `handler.on_...(args...)` if the handler has a matching member function and does nothing otherwise.
+     */
+#define FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(name)                                                    \
+    struct name##_call {                                                                                  \
+        template<typename H, typename... A>                                                              \
+        auto operator()(H &handler, A... args) const -> decltype(handler.name(args...)) {                \
+            return handler.name(args...);                                                                \
+        }                                                                                                 \
+    };
+
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_note_off)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_note_on)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_polyphonic_key_pressure)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_control_change)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_program_change)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_channel_pressure)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_pitch_wheel_change)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_sysex)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_song_position_pointer)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_song_select)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_system)
+    FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL(on_realtime)
+
+#undef FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_CALL
+
+    template<typename Call, typename H, typename... A>
+    constexpr bool has_handler_v = std::is_invocable_v<Call, H &, A...>;
+
+    /*
+     * Decodes messages from a buffer and passes them to member functions of `handler` without constructing a
+     * midi_message_t. Only the member functions the handler has are called; everything else is skipped by length:
+     *
+     *   on_note_off(channel, key, velocity)          on_sysex(id, std::string_view payload)
+     *   on_note_on(channel, key, velocity)           on_song_position_pointer(uint16_t position)
+     *   on_polyphonic_key_pressure(channel, key, p)  on_song_select(song)
+     *   on_control_change(channel, controller, v)    on_system(status)     (tune request, undefined, stray F7)
+     *   on_program_change(channel, program)          on_realtime(status)   (also inside sysex messages)
+     *   on_channel_pressure(channel, pressure)
+     *   on_pitch_wheel_change(channel, uint16_t value)
+     *
+     * All arguments except position and value are uint8_t; position and value are stored like in
+     * song_position_pointer_t and pitch_wheel_change_t. Sysex payloads are passed as views into the buffer unless
+     * real-time bytes have to be removed; real-time bytes inside a sysex message are visited before the sysex message.
+     * Running status is supported like in running_status_decoder.
+     */
+    template<typename Handler>
+    struct midi_visitor {
+        static constexpr bool wants_sysex = has_handler_v<on_sysex_call, Handler, uint8_t, std::string_view>;
+        static constexpr bool wants_realtime = has_handler_v<on_realtime_call, Handler, uint8_t>;
+
+        Handler handler;
+        uint8_t running_status{0};
+        // sysex payload without real-time bytes
+        std::string payload{};
+
+        explicit midi_visitor(Handler h) : handler(std::move(h)) {}
+
+        /*
+         * Visits a single message. Returns the same status as try_decode_midi_message.
+         */
+        decode_status visit(const uint8_t *data, size_t size, size_t &length) {
+            if (size == 0) return DECODE_END_OF_INPUT;
+            auto status = data[0];
+            auto it = data + 1;
+            if (!(status & 128u)) {
+                if (!running_status) return DECODE_INVALID_STATUS;
+                status = running_status;
+                it = data;
+            }
+            const auto end = data + size;
+            const auto &info = status_table[status];
+            if (static_cast<size_t>(end - it) < info.data_length) return DECODE_NEED_MORE_DATA;
+            const uint8_t channel = status_get_channel(status);
+            switch (info.kind) {
+                case STATUS_NOTE_OFF:
+                    call(on_note_off_call{}, channel, it[0], it[1]);
+                    break;
+                case STATUS_NOTE_ON:
+                    call(on_note_on_call{}, channel, it[0], it[1]);
+                    break;
+                case STATUS_POLYPHONIC_KEY_PRESSURE:
+                    call(on_polyphonic_key_pressure_call{}, channel, it[0], it[1]);
+                    break;
+                case STATUS_CONTROL_CHANGE:
+                    call(on_control_change_call{}, channel, it[0], it[1]);
+                    break;
+                case STATUS_PROGRAM_CHANGE:
+                    call(on_program_change_call{}, channel, it[0]);
+                    break;
+                case STATUS_CHANNEL_PRESSURE:
+                    call(on_channel_pressure_call{}, channel, it[0]);
+                    break;
+                case STATUS_PITCH_WHEEL_CHANGE:
+                    call(on_pitch_wheel_change_call{}, channel, pitch_wheel_change_t(it[0], it[1]).pitch_wheel);
+                    break;
+                case STATUS_SYSEX: {
+                    const auto sysex_end = find_sysex_end(it, end);
+                    if (sysex_end == end) return DECODE_NEED_MORE_DATA;
+                    if (sysex_end == it) return DECODE_EMPTY_SYSEX;
+                    visit_sysex(it, sysex_end);
+                    length = sysex_end - data + 1;
+                    running_status = 0;
+                    return DECODE_OK;
+                }
+                case STATUS_SONG_POSITION_POINTER:
+                    call(on_song_position_pointer_call{}, song_position_pointer_t(it[0], it[1]).song_position);
+                    break;
+                case STATUS_SONG_SELECT:
+                    call(on_song_select_call{}, it[0]);
+                    break;
+                case STATUS_SYSTEM:
+                    call(on_system_call{}, status);
+                    break;
+                case STATUS_REALTIME:
+                    call(on_realtime_call{}, status);
+                    break;
+                default:
+                    return DECODE_INVALID_STATUS;
+            }
+            if (info.kind < STATUS_SYSEX) {
+                running_status = status;
+            } else if (info.kind != STATUS_REALTIME) {
+                running_status = 0;
+            }
+            length = it - data + info.data_length;
+            return DECODE_OK;
+        }
+
+        /*
+         * Visits messages until the buffer ends or a message cannot be decoded. `count` is the number of messages
+         * visited, `consumed` the number of bytes; `status` is DECODE_END_OF_INPUT if the whole buffer was visited.
+         */
+        decode_batch_t visit_all(const uint8_t *data, size_t size) {
+            decode_batch_t result{};
+            for (;;) {
+                size_t length = 0;
+                result.status = visit(data + result.consumed, size - result.consumed, length);
+                if (result.status != DECODE_OK) return result;
+                result.consumed += length;
+                ++result.count;
+            }
+        }
+
+        void reset() {
+            running_status = 0;
+        }
+
+        template<typename Call, typename... A>
+        void call(Call c, A... args) {
+            if constexpr (has_handler_v<Call, Handler, A...>) c(handler, args...);
+        }
+
+        void visit_sysex(const uint8_t *begin, const uint8_t *end) {
+            if constexpr (!wants_sysex && !wants_realtime) {
+                return;
+            } else {
+                const auto id = *begin++;
+                const auto status = find_status_byte(begin, end);
+                if (status == end) {
+                    // no real-time bytes, pass the payload in place
+                    if constexpr (wants_sysex) handler.on_sysex(id, {reinterpret_cast<const char *>(begin),
+                                                                     static_cast<size_t>(end - begin)});
+                    return;
+                }
+                if constexpr (wants_sysex) {
+                    payload.resize(end - begin);
+                    payload.resize(copy_sysex_payload(begin, end, payload.data(), [this](uint8_t c) {
+                        call(on_realtime_call{}, c);
+                    }));
+                    handler.on_sysex(id, std::string_view(payload));
+                } else {
+                    for_each_status_byte(status, end, [this](const uint8_t *c) {
+                        if (*c >= 0xf8u) call(on_realtime_call{}, *c);
+                    });
+                }
+            }
+        }
+    };
+
+    template<typename Handler>
+    midi_visitor<Handler> make_midi_visitor(Handler handler) {
+        return midi_visitor<Handler>(std::move(handler));
+    }
+
+}
+
+#endif //FORMAT_COMMONS_AUDIO_X_MIDI_VISITOR_HPP
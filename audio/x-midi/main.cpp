@@ -34,12 +34,12 @@ using namespace format::audio::x_midi;
 #define UNDEFINEDFORMAT             "undefined                           "
 
 int main() {
-    using F = Format<MidiMessage>;
     midi_message_t message;
+    running_status_reader reader(std::cin);
 
     try {
         while (!std::cin.eof()) {
-            F::reader(std::cin).read(message);
+            reader.read(message);
             const auto channel = status_get_channel(message.status);
             const auto type = status_get_type(message.status);
             if (channel == 10 && type == NOTEOFF) {
@@ -17,9 +17,15 @@
 #include <format.hpp>
 #include <format-commons/audio/x-midi.hpp>
 
+#include <atomic>
 #include <fstream>
+#include <iterator>
+#include <memory_resource>
 #include <sstream>
 #include <cassert>
+#include <memory>
+#include <thread>
+#include <tuple>
 
 using namespace format;
 using namespace format::audio::x_midi;
@@ -40,6 +46,65 @@ struct controller_state_test: public controller_state {
     }
 };
 
+struct message_collector {
+    std::vector<midi_message_t> messages;
+
+    void add(uint8_t status, decltype(midi_message_t::message) message) {
+        messages.push_back(midi_message_t{});
+        messages.back().status = status;
+        messages.back().message = std::move(message);
+    }
+
+    void on_note_off(uint8_t channel, uint8_t key, uint8_t velocity) {
+        add(make_status_byte(NOTEOFF, channel), note_off_t(key, velocity));
+    }
+
+    void on_note_on(uint8_t channel, uint8_t key, uint8_t velocity) {
+        add(make_status_byte(NOTEON, channel), note_on_t(key, velocity));
+    }
+
+    void on_polyphonic_key_pressure(uint8_t channel, uint8_t key, uint8_t pressure) {
+        add(make_status_byte(POLYPHONICKEYPRESSURE, channel), polyphonic_key_pressure_t(key, pressure));
+    }
+
+    void on_control_change(uint8_t channel, uint8_t controller, uint8_t value) {
+        add(make_status_byte(CONTROLCHANGE, channel), control_change_t(controller, value));
+    }
+
+    void on_program_change(uint8_t channel, uint8_t program) {
+        add(make_status_byte(PROGRAMCHANGE, channel), program_change_t(program));
+    }
+
+    void on_channel_pressure(uint8_t channel, uint8_t pressure) {
+        add(make_status_byte(CHANNELPRESSURE, channel), channel_pressure_t(pressure));
+    }
+
+    void on_pitch_wheel_change(uint8_t channel, uint16_t value) {
+        add(make_status_byte(PITCHWHEELCHANGE, channel), pitch_wheel_change_t(value & 0xffu, value >> 8u));
+    }
+
+    void on_sysex(uint8_t id, std::string_view payload) {
+        add(make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE), system_message_t{sysex_message_t(id, std::string(payload))});
+    }
+
+    void on_song_position_pointer(uint16_t position) {
+        add(make_status_byte(SYSTEMMESSAGE, SONG_POSITION_POINTER),
+            system_message_t{song_position_pointer_t(position & 0xffu, position >> 8u)});
+    }
+
+    void on_song_select(uint8_t song) {
+        add(make_status_byte(SYSTEMMESSAGE, SONG_SELECT), system_message_t{song_select_t(song)});
+    }
+
+    void on_system(uint8_t status) {
+        add(status, system_message_t{uint8_t{0}});
+    }
+
+    void on_realtime(uint8_t status) {
+        add(status, system_message_t{uint8_t{0}});
+    }
+};
+
 int main(int argc, char** argv) {
     int tc = 1;
     using F = Format<MidiMessage>;
@@ -186,9 +251,20 @@ int main(int argc, char** argv) {
             F::reader(sd).read(message);
             assert(message.status == make_status_byte(CONTROLCHANGE, 0));
             auto cm = std::get<control_change_t>(message.message);
-            state.apply(cm.controller, cm.value);
-            assert(state.last_controller == c);
-            assert(state.last_value == v);
+            const auto previous = state.get(c);
+            const auto last_controller = state.last_controller;
+            const auto last_value = state.last_value;
+            const auto changed = state.apply(cm.controller, cm.value);
+            assert(state.get(c) == v);
+            // only real changes are reported
+            assert(changed == (previous != v));
+            if (changed) {
+                assert(state.last_controller == c);
+                assert(state.last_value == v);
+            } else {
+                assert(state.last_controller == last_controller);
+                assert(state.last_value == last_value);
+            }
         };
 
         auto skip = [&sd, &message]() {
@@ -259,5 +335,1094 @@ int main(int argc, char** argv) {
         skip();
         assertCC(EFFECTS_3_DEPTH_LSB, 0);
     }
+    TEST("Span Decoder (recorded)");
+    {
+        for (auto name : {"test0", "test1", "test2", "test3", "test4", "test5", "test6"}) {
+            std::stringbuf fd;
+            get_file(name) >> &fd;
+            const auto input = fd.str();
+            const auto *data = reinterpret_cast<const uint8_t *>(input.data());
+
+            std::stringstream sd;
+            sd.str(input);
+
+            size_t offset = 0;
+            midi_message_t message, expected;
+            while (offset < input.size()) {
+                F::reader(sd).read(expected);
+                offset += decode_midi_message(data + offset, input.size() - offset, message);
+                assert(message == expected);
+                assert(static_cast<size_t>(sd.tellg()) == offset);
+            }
+        }
+
+        const uint8_t partial[] = {0x90, 0x3b};
+        midi_message_t message;
+        try {
+            decode_midi_message(partial, sizeof(partial), message);
+            assert(false);
+        } catch (truncated_midi_message &) {}
+        try {
+            decode_midi_message(partial + 1, 1, message);
+            assert(false);
+        } catch (invalid_status_byte &e) {
+            assert(e.value == 0x3b);
+        }
+    }
+    TEST("Running Status");
+    {
+        const uint8_t input[] = {0xb0, 0x40, 0x7f, 0x40, 0x00, 0xf8, 0x07, 0x10, 0xc1, 0x05, 0x06, 0xf2, 0x00, 0x10, 0x10};
+        const midi_message_t expected[] = {
+                {make_status_byte(CONTROLCHANGE, 0), control_change_t(DAMPER_PEDAL_ON_OFF_SUSTAIN, 127u)},
+                {make_status_byte(CONTROLCHANGE, 0), control_change_t(DAMPER_PEDAL_ON_OFF_SUSTAIN, 0u)},
+                {make_status_byte(SYSTEMMESSAGE, TIMING_CLOCK), system_message_t{uint8_t{0}}},
+                {make_status_byte(CONTROLCHANGE, 0), control_change_t(CHANNEL_VOLUME_FORMERLY_MAIN_VOLUME_MSB, 16u)},
+                {make_status_byte(PROGRAMCHANGE, 1), program_change_t(5u)},
+                {make_status_byte(PROGRAMCHANGE, 1), program_change_t(6u)},
+                {make_status_byte(SYSTEMMESSAGE, SONG_POSITION_POINTER), system_message_t{song_position_pointer_t(0u, 16u)}},
+        };
+
+        running_status_decoder decoder;
+        midi_message_t message;
+        size_t offset = 0;
+        for (const auto &e : expected) {
+            offset += decoder.decode(input + offset, sizeof(input) - offset, message);
+            assert(message == e);
+        }
+        // song position pointer cleared the running status
+        try {
+            decoder.decode(input + offset, sizeof(input) - offset, message);
+            assert(false);
+        } catch (invalid_status_byte &e) {
+            assert(e.value == 0x10);
+        }
+
+        std::stringstream sd;
+        sd.str(std::string(reinterpret_cast<const char *>(input), offset));
+        running_status_reader reader(sd);
+        for (const auto &e : expected) {
+            reader.read(message);
+            assert(message == e);
+        }
+
+        sd.clear();
+        sd.str("");
+        running_status_writer writer(sd);
+        for (const auto &e : expected) {
+            writer.write(e);
+        }
+        assert(sd.str() == std::string(reinterpret_cast<const char *>(input), offset));
+
+        const uint8_t refreshed[] = {0xb0, 0x40, 0x7f, 0x40, 0x00, 0xf8, 0xb0, 0x07, 0x10, 0xc1, 0x05, 0x06, 0xf2, 0x00, 0x10};
+        sd.clear();
+        sd.str("");
+        running_status_writer refresh_writer(sd, 1);
+        for (const auto &e : expected) {
+            refresh_writer.write(e);
+        }
+        assert(sd.str() == std::string(reinterpret_cast<const char *>(refreshed), sizeof(refreshed)));
+    }
+    TEST("Batch Decoder (recorded)");
+    {
+        std::stringbuf fd;
+        get_file("test6") >> &fd;
+        const auto input = fd.str();
+        const auto *data = reinterpret_cast<const uint8_t *>(input.data());
+
+        std::vector<midi_message_t> expected;
+        for (size_t offset = 0; offset < input.size();) {
+            offset += decode_midi_message(data + offset, input.size() - offset, expected.emplace_back());
+        }
+
+        std::vector<midi_message_t> messages(expected.size());
+        size_t count = 0, consumed = 0;
+        decode_batch_t result;
+        do {
+            result = decode_midi_messages(data + consumed, input.size() - consumed, messages.data() + count, 4);
+            assert(result.count == 4 || result.status != DECODE_OK);
+            count += result.count;
+            consumed += result.consumed;
+        } while (result.status == DECODE_OK);
+        assert(result.status == DECODE_END_OF_INPUT);
+        assert(count == expected.size() && consumed == input.size());
+        assert(messages == expected);
+
+        running_status_decoder decoder;
+        result = decoder.decode(data, input.size() - 1, messages.data(), messages.size());
+        assert(result.status == DECODE_NEED_MORE_DATA);
+        assert(result.count == expected.size() - 1);
+        assert(result.consumed == input.size() - 3);
+
+        const uint8_t invalid[] = {0xf2, 0x00, 0x10, 0x10};
+        result = decoder.decode(invalid, sizeof(invalid), messages.data(), messages.size());
+        assert(result.status == DECODE_INVALID_STATUS && result.count == 1 && result.consumed == 3);
+    }
+    TEST("Compact Events (recorded)");
+    {
+        std::stringbuf fd;
+        get_file("test6") >> &fd;
+        const auto input = fd.str();
+        const auto *data = reinterpret_cast<const uint8_t *>(input.data());
+
+        sysex_heap heap;
+        std::vector<midi_message_t> messages;
+        std::vector<midi_event_t> events;
+        for (size_t offset = 0; offset < input.size();) {
+            offset += decode_midi_message(data + offset, input.size() - offset, messages.emplace_back());
+            events.push_back(make_midi_event(messages.back(), heap));
+        }
+        assert(heap.size() == 18);
+        assert(events[3].status == make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE) && events[3].data1 == 0x43);
+        assert(heap.get(events[3].sysex) == std::string("\x10\x4c\x02\x01\x00\x01\x10", 7));
+
+        for (size_t i = 0; i < events.size(); ++i) {
+            assert(make_midi_message(events[i], heap) == messages[i]);
+        }
+
+        const midi_message_t wheel(make_status_byte(PITCHWHEELCHANGE, 3), pitch_wheel_change_t(0x12u, 0x34u));
+        const auto event = make_midi_event(wheel, heap);
+        assert(event.data1 == 0x12 && event.data2 == 0x34);
+        assert(make_midi_message(event, heap) == wheel);
+    }
+    TEST("Sysex Arena (recorded)");
+    {
+        std::stringbuf fd;
+        get_file("test6") >> &fd;
+        const auto input = fd.str();
+        const auto *data = reinterpret_cast<const uint8_t *>(input.data());
+
+        // everything has to fit into the buffer, null_memory_resource throws otherwise
+        char buffer[4096];
+        std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+        sysex_heap heap(&arena), reference;
+        midi_message_t message;
+        size_t length;
+        for (size_t offset = 0; offset < input.size(); offset += length) {
+            midi_event_t event;
+            assert(try_decode_midi_event(data + offset, input.size() - offset, event, heap, length) == DECODE_OK);
+            decode_midi_message(data + offset, input.size() - offset, message);
+            assert(event == make_midi_event(message, reference));
+            assert(make_midi_message(event, heap) == message);
+        }
+        assert(heap.size() == 18);
+
+        // identity request, stored inline
+        const uint8_t identity_request[] = {0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7};
+        midi_event_t event;
+        assert(try_decode_midi_event(identity_request, sizeof(identity_request), event, heap, length) == DECODE_OK);
+        assert(length == sizeof(identity_request));
+        assert(event.has_inline_sysex() && event.data1 == 0x7e);
+        assert(heap.get(event) == "\x7f\x06\x01");
+        assert(heap.size() == 18);
+
+        // a wire EOX or System Reset has the status of an SMF payload event, but no payload
+        sysex_heap empty;
+        for (const uint8_t status : {0xf7, 0xff}) {
+            assert(try_decode_midi_event(&status, 1, event, empty, length) == DECODE_OK);
+            assert(length == 1 && !event.has_payload() && !event.has_inline_sysex());
+            assert(empty.get(event).empty());
+        }
+    }
+    TEST("Stream Parser (recorded)");
+    {
+        for (auto name : {"test4", "test5", "test6"}) {
+            std::stringbuf fd;
+            get_file(name) >> &fd;
+            const auto input = fd.str();
+            const auto *data = reinterpret_cast<const uint8_t *>(input.data());
+
+            std::vector<midi_message_t> expected;
+            for (size_t offset = 0; offset < input.size();) {
+                offset += decode_midi_message(data + offset, input.size() - offset, expected.emplace_back());
+            }
+
+            for (size_t chunk : {1, 2, 3, 7, 64}) {
+                std::vector<midi_message_t> messages;
+                midi_stream_parser parser([&messages](const midi_message_t &m) {
+                    messages.push_back(m);
+                });
+                for (size_t offset = 0; offset < input.size(); offset += chunk) {
+                    parser.feed(data + offset, std::min(chunk, input.size() - offset));
+                }
+                assert(messages == expected);
+                assert(parser.dropped == 0);
+            }
+        }
+
+        // running status and real-time bytes in the middle of a message
+        const uint8_t input[] = {0x90, 0x3b, 0xf8, 0x3a, 0x3c, 0x3a, 0xf2, 0x00, 0x10, 0x10, 0xf0, 0xf7};
+        std::vector<midi_message_t> messages;
+        midi_stream_parser parser([&messages](const midi_message_t &m) {
+            messages.push_back(m);
+        });
+        for (auto c : input) {
+            parser.feed(&c, 1);
+        }
+        assert(messages.size() == 4);
+        assert(messages[0] == midi_message_t(make_status_byte(SYSTEMMESSAGE, TIMING_CLOCK), system_message_t{uint8_t{0}}));
+        assert(messages[1] == midi_message_t(make_status_byte(NOTEON, 0), note_on_t(0x3bu, 0x3au)));
+        assert(messages[2] == midi_message_t(make_status_byte(NOTEON, 0), note_on_t(0x3cu, 0x3au)));
+        assert(std::get<song_position_pointer_t>(std::get<system_message_t>(messages[3].message)).song_position == 0x1000);
+        assert(parser.dropped == 2);
+    }
+    TEST("Sysex Fragments");
+    {
+        std::stringbuf fd;
+        get_file("test6") >> &fd;
+        auto input = fd.str();
+        // append a sample dump
+        input += '\xf0';
+        for (size_t i = 0; i < 100000; ++i) {
+            input += static_cast<char>(i & 127u);
+        }
+        input += '\xf7';
+        const auto *data = reinterpret_cast<const uint8_t *>(input.data());
+
+        std::vector<midi_message_t> expected;
+        for (size_t offset = 0; offset < input.size();) {
+            offset += decode_midi_message(data + offset, input.size() - offset, expected.emplace_back());
+        }
+
+        struct handler_t {
+            using sysex_fragments = std::true_type;
+
+            std::vector<midi_message_t> &messages;
+            sysex_message_t sysex{};
+
+            void operator()(const midi_message_t &message) {
+                messages.push_back(message);
+            }
+
+            void operator()(const sysex_fragment_t &fragment) {
+                assert(fragment.data.size() <= 64);
+                assert(!fragment.aborted);
+                if (fragment.first) sysex = sysex_message_t(fragment.id, "");
+                sysex.message.append(fragment.data);
+                if (fragment.last) messages.emplace_back(make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE), system_message_t{sysex});
+            }
+        };
+
+        std::vector<midi_message_t> messages;
+        midi_stream_parser parser(handler_t{messages}, 64);
+        static_assert(decltype(parser)::fragmented);
+        // handlers have to opt in, generic lambdas collect sysex messages
+        auto generic = [](const auto &) {};
+        static_assert(!midi_stream_parser<decltype(generic)>::fragmented);
+        for (size_t offset = 0; offset < input.size(); offset += 1000) {
+            parser.feed(data + offset, std::min<size_t>(1000, input.size() - offset));
+        }
+        assert(messages == expected);
+        assert(parser.dropped == 0);
+    }
+    TEST("Real-Time in Sysex");
+    {
+        const uint8_t input[] = {0xf0, 0x43, 0x10, 0xf8, 0x4c, 0x02, 0xfa, 0x01, 0xf7, 0x90, 0x3b, 0x3a};
+        const midi_message_t sysex(make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE),
+                                   system_message_t{sysex_message_t({0x43, 0x10, 0x4c, 0x02, 0x01})});
+        const midi_message_t expected[] = {
+                {make_status_byte(SYSTEMMESSAGE, TIMING_CLOCK), system_message_t{uint8_t{0}}},
+                {make_status_byte(SYSTEMMESSAGE, START), system_message_t{uint8_t{0}}},
+                sysex,
+                {make_status_byte(NOTEON, 0), note_on_t(0x3bu, 0x3au)},
+        };
+
+        // buffer decoder
+        std::vector<uint8_t> realtime;
+        midi_message_t message;
+        size_t length;
+        assert(try_decode_midi_message(input, sizeof(input), message, length, [&realtime](uint8_t c) {
+            realtime.push_back(c);
+        }) == DECODE_OK);
+        assert(length == 9 && message == sysex);
+        assert(realtime == std::vector<uint8_t>({0xf8, 0xfa}));
+
+        // without a handler, real-time bytes are dropped like in MidiMessage
+        assert(decode_midi_message(input, sizeof(input), message) == 9 && message == sysex);
+
+        // stream parser
+        std::vector<midi_message_t> messages;
+        midi_stream_parser parser([&messages](const midi_message_t &m) {
+            messages.push_back(m);
+        });
+        parser.feed(input, sizeof(input));
+        assert(messages == std::vector<midi_message_t>(std::begin(expected), std::end(expected)));
+
+        // stream reader
+        std::stringstream sd;
+        sd.str(std::string(reinterpret_cast<const char *>(input), sizeof(input) - 3));
+        running_status_reader reader(sd);
+        for (size_t i = 0; i < 3; ++i) {
+            reader.read(message);
+            assert(message == expected[i]);
+        }
+    }
+    TEST("Ring Buffers");
+    {
+        constexpr uint32_t count = 100000;
+
+        auto spsc = std::make_unique<spsc_ring_buffer<midi_event_t, 256>>();
+        std::thread producer([&spsc]() {
+            for (uint32_t i = 0; i < count; ++i) {
+                while (!spsc->try_push(midi_event_t{make_status_byte(NOTEON, 0), 60, 100, 0, i})) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        for (uint32_t i = 0; i < count; ++i) {
+            midi_event_t event;
+            while (!spsc->try_pop(event)) {
+                std::this_thread::yield();
+            }
+            assert(event.sysex == i);
+        }
+        producer.join();
+        assert(spsc->size() == 0);
+
+        auto mpsc = std::make_unique<mpsc_ring_buffer<midi_event_t, 256>>();
+        std::vector<std::thread> producers;
+        for (uint8_t channel = 0; channel < 4; ++channel) {
+            producers.emplace_back([&mpsc, channel]() {
+                for (uint32_t i = 0; i < count; ++i) {
+                    while (!mpsc->try_push(midi_event_t{static_cast<uint8_t>(make_status_byte(NOTEON, channel)), 60, 100, 0, i})) {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        uint32_t next[4]{};
+        for (uint32_t i = 0; i < 4 * count; ++i) {
+            midi_event_t event;
+            while (!mpsc->try_pop(event)) {
+                std::this_thread::yield();
+            }
+            const auto channel = status_get_channel(event.status);
+            assert(event.sysex == next[channel]++);
+        }
+        for (auto &p : producers) {
+            p.join();
+        }
+        midi_event_t event;
+        assert(!mpsc->try_pop(event));
+    }
+    TEST("Standard MIDI File Reader");
+    {
+        mapped_file file("fixtures/test7.mid");
+        smf_file smf(file);
+        assert(smf.format == 1 && smf.division == 96);
+        assert(smf.tracks.size() == 2);
+
+        smf_event_t event;
+        midi_message_t message;
+        auto conductor = smf.track(0);
+        assert(conductor.next(event) && event.is_meta() && event.meta_type == META_TRACK_NAME && event.data == "Conductor");
+        assert(conductor.next(event) && event.is_meta() && event.meta_type == META_SET_TEMPO);
+        assert(read_be(reinterpret_cast<const uint8_t *>(event.data.data()), event.data.size()) == 500000);
+        assert(conductor.next(event) && event.meta_type == META_TIME_SIGNATURE);
+        assert(conductor.next(event) && event.meta_type == META_END_OF_TRACK);
+        assert(!conductor.next(event));
+
+        auto piano = smf.track(1);
+        auto next_message = [&piano, &event, &message]() {
+            assert(piano.next(event));
+            assert(event.message(message) == DECODE_OK);
+            return message;
+        };
+        assert(piano.next(event) && event.meta_type == META_TRACK_NAME && event.data == "Piano");
+        assert(next_message() == midi_message_t(make_status_byte(PROGRAMCHANGE, 0), program_change_t(5u)));
+        assert(next_message() == midi_message_t(make_status_byte(NOTEON, 0), note_on_t(60u, 64u)));
+        // running status
+        assert(next_message() == midi_message_t(make_status_byte(NOTEON, 0), note_on_t(64u, 64u)));
+        assert(event.delta == 48 && event.tick == 48);
+        assert(next_message() == midi_message_t(make_status_byte(NOTEON, 0), note_on_t(60u, 0u)));
+        assert(event.tick == 96);
+        assert(next_message() == midi_message_t(make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE),
+                                                system_message_t{sysex_message_t({0x43, 0x10, 0x4c, 0x02, 0x01, 0x00, 0x03, 0x10})}));
+        assert(next_message() == midi_message_t(make_status_byte(CONTROLCHANGE, 0), control_change_t(DAMPER_PEDAL_ON_OFF_SUSTAIN, 127u)));
+        assert(next_message() == midi_message_t(make_status_byte(NOTEOFF, 0), note_off_t(64u, 0u)));
+        assert(event.delta == 200 && event.tick == 296);
+        assert(piano.next(event) && event.meta_type == META_END_OF_TRACK);
+        assert(!piano.next(event));
+
+        // the bodies decode like the MidiMessage grammar
+        for (auto track = smf.track(1); track.next(event);) {
+            if (event.message(message) != DECODE_OK) continue;
+            std::string wire(1, static_cast<char>(event.event.status));
+            if (event.is_sysex()) {
+                wire += event.data;
+            } else {
+                const char body[2] = {static_cast<char>(event.event.data1), static_cast<char>(event.event.data2)};
+                wire.append(body, status_data_length(event.event.status));
+            }
+            std::stringstream sd;
+            sd.str(wire);
+            midi_message_t expected;
+            F::reader(sd).read(expected);
+            assert(message == expected);
+        }
+
+        try {
+            smf_file truncated(file.data, file.size - 1);
+            assert(false);
+        } catch (invalid_smf_file &) {}
+    }
+    TEST("Standard MIDI File Writer");
+    {
+        std::stringbuf fd;
+        std::ifstream("fixtures/test7.mid", std::ios_base::in | std::ios_base::binary) >> &fd;
+        const auto expected = fd.str();
+
+        auto write = [](auto &writer) {
+            writer.begin_track();
+            writer.write_meta(0, META_TRACK_NAME, "Conductor");
+            writer.write_meta(0, META_SET_TEMPO, "\x07\xa1\x20");
+            writer.write_meta(0, META_TIME_SIGNATURE, "\x04\x02\x18\x08");
+            writer.end_track();
+
+            writer.begin_track();
+            writer.write_meta(0, META_TRACK_NAME, "Piano");
+            writer.write(0, midi_message_t(make_status_byte(PROGRAMCHANGE, 0), program_change_t(5u)));
+            writer.write(0, midi_message_t(make_status_byte(NOTEON, 0), note_on_t(60u, 64u)));
+            writer.write(48, midi_message_t(make_status_byte(NOTEON, 0), note_on_t(64u, 64u)));
+            // not stored, but its delta time is kept
+            writer.write(20, midi_message_t(make_status_byte(SYSTEMMESSAGE, TIMING_CLOCK), system_message_t{uint8_t{0}}));
+            writer.write_at(96, midi_message_t(make_status_byte(NOTEON, 0), note_on_t(60u, 0u)));
+            writer.write(0, midi_message_t(make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE),
+                                           system_message_t{sysex_message_t({0x43, 0x10, 0x4c, 0x02, 0x01, 0x00, 0x03, 0x10})}));
+            writer.write(0, midi_message_t(make_status_byte(CONTROLCHANGE, 0), control_change_t(DAMPER_PEDAL_ON_OFF_SUSTAIN, 127u)));
+            writer.write(200, midi_message_t(make_status_byte(NOTEOFF, 0), note_off_t(64u, 0u)));
+            writer.end_track();
+            writer.finish();
+        };
+
+        smf_writer buffer_writer(smf_buffer_sink{}, 1, 96);
+        write(buffer_writer);
+        const auto &buffer = buffer_writer.sink.buffer;
+        assert(std::string(buffer.begin(), buffer.end()) == expected);
+
+        // small buffers, so the track length of the first track is patched with pwrite; with 8 bytes the header and
+        // longer payloads bypass the buffer
+        for (size_t capacity : {16u, 8u}) {
+            auto file = tmpfile();
+            smf_writer fd_writer(smf_fd_sink(fileno(file), capacity), 1, 96);
+            write(fd_writer);
+            assert(fd_writer.sink.buffer.capacity() == capacity);
+            std::string written(expected.size() + 1, '\0');
+            assert(pread(fileno(file), written.data(), written.size(), 0) == static_cast<ssize_t>(expected.size()));
+            written.pop_back();
+            assert(written == expected);
+            fclose(file);
+        }
+
+        uint8_t vlq[4];
+        for (uint32_t v : {0u, 127u, 128u, 8192u, 16383u, 16384u, 0x0fffffffu}) {
+            const uint8_t *it = vlq;
+            uint32_t value;
+            const auto length = write_vlq(v, vlq);
+            assert(read_vlq(it, vlq + length, value) && value == v && it == vlq + length);
+        }
+        try {
+            write_vlq(SMF_MAX_VLQ + 1, vlq);
+            assert(false);
+        } catch (invalid_smf_value &) {}
+
+        smf_writer checked(smf_buffer_sink{}, 0, 96);
+        checked.begin_track();
+        checked.write_at(10, midi_message_t(make_status_byte(NOTEON, 0), note_on_t(60u, 64u)));
+        try {
+            checked.write_at(9, midi_message_t(make_status_byte(NOTEOFF, 0), note_off_t(60u, 0u)));
+            assert(false);
+        } catch (invalid_smf_value &) {}
+        try {
+            checked.write_at(11 + SMF_MAX_VLQ, midi_message_t(make_status_byte(NOTEOFF, 0), note_off_t(60u, 0u)));
+            assert(false);
+        } catch (invalid_smf_value &) {}
+        // finish() ends the open track, so its length is patched
+        checked.finish();
+        const auto &unterminated = checked.sink.buffer;
+        assert(read_be(unterminated.data() + 10, 2) == 1);
+        assert(read_be(unterminated.data() + 18, 4) == unterminated.size() - 22);
+    }
+    TEST("Parallel Track Decoder");
+    {
+        auto equal = [](const smf_track_events &a, const smf_track_events &b) {
+            if (a.events != b.events) return false;
+            for (size_t i = 0; i < a.events.size(); ++i) {
+                if (a.events[i].event.has_payload() && a.payload(a.events[i]) != b.payload(b.events[i])) return false;
+            }
+            return true;
+        };
+
+        mapped_file file("fixtures/test7.mid");
+        smf_file smf(file);
+        const auto tracks = decode_smf_tracks(smf, 4);
+        assert(tracks.size() == 2);
+        for (size_t i = 0; i < tracks.size(); ++i) assert(equal(tracks[i], decode_smf_track(smf.tracks[i])));
+
+        const auto &conductor = tracks[0];
+        assert(conductor.events.size() == 4);
+        assert(conductor.events[0].event.status == SMF_META_EVENT && conductor.events[0].event.data1 == META_TRACK_NAME);
+        assert(conductor.payload(conductor.events[0]) == "Conductor");
+        assert(conductor.payload(conductor.events[1]) == "\x07\xa1\x20");
+        assert(conductor.events[3].event.data1 == META_END_OF_TRACK);
+
+        const auto &piano = tracks[1];
+        assert(piano.events[2] == (smf_timed_event_t{0, midi_event_t{make_status_byte(NOTEON, 0), 60u, 64u}}));
+        assert(piano.events[3] == (smf_timed_event_t{48, midi_event_t{make_status_byte(NOTEON, 0), 64u, 64u}}));
+        assert(piano.events[5].tick == 96 && piano.events[5].event.is_sysex() && piano.events[5].event.data1 == 0x43);
+        assert(piano.payload(piano.events[5]) == std::string_view("\x10\x4c\x02\x01\x00\x03\x10", 7));
+        assert(piano.events[7].tick == 296);
+
+        // many tracks of different sizes, decoded on a varying number of threads
+        smf_writer writer(smf_buffer_sink{}, 1, 96);
+        for (unsigned t = 0; t < 64; ++t) {
+            writer.begin_track();
+            for (unsigned i = 0; i < t * 37 % 101; ++i) {
+                writer.write(i % 3, midi_message_t(make_status_byte(NOTEON, t % 16), note_on_t(i % 128, t)));
+                if (i % 17 == 0) {
+                    writer.write(0, midi_message_t(make_status_byte(SYSTEMMESSAGE, SYSEX_MESSAGE),
+                                                   system_message_t{sysex_message_t(0x7d, std::string(i % 9, 'a'))}));
+                }
+            }
+            writer.end_track();
+        }
+        writer.finish();
+        const auto &buffer = writer.sink.buffer;
+        smf_file many(buffer.data(), buffer.size());
+        std::vector<smf_track_events> sequential;
+        for (const auto &track : many.tracks) sequential.push_back(decode_smf_track(track));
+        for (unsigned threads : {1u, 2u, 3u, 8u, 100u}) {
+            const auto parallel = decode_smf_tracks(many, threads);
+            assert(parallel.size() == 64);
+            for (size_t i = 0; i < parallel.size(); ++i) assert(equal(parallel[i], sequential[i]));
+        }
+
+        // errors are reported after all threads are done
+        auto broken = buffer;
+        broken[many.tracks[10].data() - reinterpret_cast<const char *>(buffer.data()) + 1] = 0x42;
+        smf_file broken_file(broken.data(), broken.size());
+        bool thrown = false;
+        try {
+            decode_smf_tracks(broken_file, 4);
+        } catch (invalid_smf_file &) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    TEST("Merge");
+    {
+        mapped_file file("fixtures/test7.mid");
+        smf_file smf(file);
+        auto merge = merge_smf_tracks(smf);
+        smf_event_t event;
+        size_t source;
+        std::vector<std::pair<uint64_t, size_t>> order;
+        while (merge.next(event, source)) order.emplace_back(event.tick, source);
+        // the conductor track comes first on ties
+        assert((order == std::vector<std::pair<uint64_t, size_t>>{
+                {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 1}, {0, 1}, {0, 1}, {48, 1}, {96, 1}, {96, 1}, {96, 1}, {296, 1},
+                {296, 1}}));
+
+        // same result as a stable sort of all events
+        std::vector<std::vector<smf_timed_event_t>> tracks(16);
+        std::vector<std::pair<smf_timed_event_t, size_t>> all;
+        for (size_t t = 0; t < tracks.size(); ++t) {
+            uint64_t tick = 0;
+            for (unsigned i = 0; i < t * 13 % 50; ++i) {
+                tick += (i * t) % 4;
+                tracks[t].push_back({tick, midi_event_t{uint8_t(make_status_byte(NOTEON, t)), uint8_t(i), 64u}});
+                all.emplace_back(tracks[t].back(), t);
+            }
+        }
+        std::stable_sort(all.begin(), all.end(), [](const auto &a, const auto &b) {
+            return a.first.tick < b.first.tick;
+        });
+        std::vector<timed_event_source> sources;
+        for (const auto &track : tracks) sources.emplace_back(track);
+        midi_merge<timed_event_source> timed(std::move(sources));
+        smf_timed_event_t timed_event;
+        for (const auto &expected : all) {
+            assert(timed.next(timed_event, source));
+            assert(timed_event == expected.first && source == expected.second);
+        }
+        assert(!timed.next(timed_event));
+
+        // a sysex message split into three parts; the note of the second track must not land inside it
+        const uint8_t split[] = {0x00, 0xf0, 0x03, 0x43, 0x10, 0x4c,
+                                 0x0a, 0xf7, 0x02, 0x02, 0x01,
+                                 0x0a, 0xf7, 0x02, 0x00, 0xf7,
+                                 0x00, 0xf7, 0x01, 0xf3, // escaped song select, not part of a sysex message
+                                 0x00, 0xff, 0x2f, 0x00};
+        const uint8_t notes[] = {0x05, 0x90, 0x3c, 0x40, 0x00, 0xff, 0x2f, 0x00};
+        midi_merge<smf_track_source> split_merge({smf_track_source(smf_track_reader(split, sizeof(split))),
+                                                  smf_track_source(smf_track_reader(notes, sizeof(notes)))});
+        std::vector<std::tuple<uint64_t, size_t, uint8_t>> events;
+        while (split_merge.next(event, source)) events.emplace_back(event.tick, source, event.event.status);
+        assert((events == std::vector<std::tuple<uint64_t, size_t, uint8_t>>{
+                {0, 0, 0xf0}, {10, 0, 0xf7}, {20, 0, 0xf7}, {20, 1, 0x90}, {20, 1, 0xff}, {20, 0, 0xf7}, {20, 0, 0xff}}));
+
+        // the same for decoded tracks
+        const auto split_events = decode_smf_track({reinterpret_cast<const char *>(split), sizeof(split)});
+        const auto note_events = decode_smf_track({reinterpret_cast<const char *>(notes), sizeof(notes)});
+        assert(split_events.events[0].event.flags & MIDI_EVENT_SYSEX_UNTERMINATED);
+        assert(split_events.events[2].event.flags & MIDI_EVENT_SYSEX_TERMINATOR);
+        midi_merge<timed_event_source> decoded_merge({timed_event_source(split_events.events),
+                                                      timed_event_source(note_events.events)});
+        std::vector<std::tuple<uint64_t, size_t, uint8_t>> decoded;
+        while (decoded_merge.next(timed_event, source)) {
+            decoded.emplace_back(timed_event.tick, source, timed_event.event.status);
+        }
+        assert(decoded == events);
+    }
+    TEST("Status Table");
+    {
+        static_assert(status_table[0x90].kind == STATUS_NOTE_ON && status_table[0x90].data_length == 2);
+        static_assert(status_table[0xc5].kind == STATUS_PROGRAM_CHANGE && status_table[0xc5].data_length == 1);
+        static_assert(status_table[0xf2].kind == STATUS_SONG_POSITION_POINTER && status_data_length(0xf2) == 2);
+        static_assert(status_table[0x45].kind == STATUS_NONE);
+
+        // every status byte decodes to the alternative of its kind
+        const uint8_t data[] = {0x12, 0x34, 0b11110111};
+        for (unsigned status = 0; status < 256; ++status) {
+            const auto &info = status_table[status];
+            midi_message_t message;
+            size_t length;
+            const auto result = try_decode_midi_message_data(status, data, sizeof(data), message, length);
+            if (info.kind == STATUS_NONE) {
+                assert(status < 0x80u && result == DECODE_INVALID_STATUS);
+                continue;
+            }
+            assert(result == DECODE_OK && message.status == status);
+            if (info.kind < STATUS_SYSEX) {
+                assert(message.message.index() == info.kind);
+                assert(length == info.data_length);
+                assert(info.data_length == (status_get_type(status) == PROGRAMCHANGE ||
+                                            status_get_type(status) == CHANNELPRESSURE ? 1u : 2u));
+                continue;
+            }
+            const auto &system = std::get<system_message_t>(message.message);
+            assert(status_get_type(status) == SYSTEMMESSAGE);
+            assert(system.index() == std::min<size_t>(info.kind - STATUS_SYSEX, 3));
+            assert((info.kind == STATUS_REALTIME) == (status >= 0xf8u));
+            assert(length == (info.kind == STATUS_SYSEX ? 3 : info.data_length));
+        }
+    }
+    TEST("Visitor (recorded)");
+    {
+        std::stringbuf fd;
+        get_file("test6") >> &fd;
+        const auto input = fd.str();
+        const auto *data = reinterpret_cast<const uint8_t *>(input.data());
+
+        std::vector<midi_message_t> expected;
+        for (size_t offset = 0; offset < input.size();) {
+            offset += decode_midi_message(data + offset, input.size() - offset, expected.emplace_back());
+        }
+
+        // same messages as the decoder, without going through midi_message_t in the decoder
+        auto visitor = make_midi_visitor(message_collector{});
+        auto result = visitor.visit_all(data, input.size());
+        assert(result.status == DECODE_END_OF_INPUT && result.consumed == input.size());
+        assert(result.count == expected.size());
+        assert(visitor.handler.messages == expected);
+
+        // handlers without a member function for a message kind skip it
+        struct note_counter {
+            size_t notes{0};
+            size_t clocks{0};
+
+            void on_note_on(uint8_t, uint8_t, uint8_t velocity) {
+                if (velocity) ++notes;
+            }
+
+            void on_realtime(uint8_t status) {
+                if (status == make_status_byte(SYSTEMMESSAGE, TIMING_CLOCK)) ++clocks;
+            }
+        };
+        midi_visitor<note_counter> counter(note_counter{});
+        const uint8_t stream[] = {0x90, 0x3c, 0x40, 0x3e, 0x40, 0xf8, 0x40, 0x00, 0xf0, 0x43, 0x10, 0xf8, 0x4c, 0xf7,
+                                  0xb0, 0x07, 0x64, 0xe0, 0x00, 0x40, 0x90, 0x3c, 0x00};
+        result = counter.visit_all(stream, sizeof(stream));
+        assert(result.status == DECODE_END_OF_INPUT && result.count == 8);
+        assert(counter.handler.notes == 2 && counter.handler.clocks == 2);
+
+        // sysex payloads are passed in place unless real-time bytes are removed
+        auto sysex = make_midi_visitor(message_collector{});
+        assert(sysex.visit_all(stream + 5, sizeof(stream) - 5).status == DECODE_INVALID_STATUS);
+        assert(sysex.visit_all(stream + 8, sizeof(stream) - 8).status == DECODE_END_OF_INPUT);
+        assert(sysex.handler.messages.size() == 6);
+        // real-time byte inside the sysex message first
+        assert(sysex.handler.messages[1] == midi_message_t(0xf8, system_message_t{uint8_t{0}}));
+        assert(sysex.handler.messages[2] == midi_message_t(0xf0, system_message_t{sysex_message_t(0x43, "\x10\x4c")}));
+        assert(sysex.payload == "\x10\x4c");
+    }
+    TEST("Filtered Decoder (recorded)");
+    {
+        std::stringbuf fd;
+        get_file("test6") >> &fd;
+        const auto input = fd.str();
+        const auto *data = reinterpret_cast<const uint8_t *>(input.data());
+
+        std::vector<midi_message_t> all;
+        for (size_t offset = 0; offset < input.size();) {
+            offset += decode_midi_message(data + offset, input.size() - offset, all.emplace_back());
+        }
+
+        auto check = [&](auto filter, auto accepted) {
+            std::vector<midi_message_t> expected;
+            std::copy_if(all.begin(), all.end(), std::back_inserter(expected), accepted);
+            std::vector<midi_message_t> messages(all.size());
+            auto decoder = make_filtered_decoder(filter);
+            const auto result = decoder.decode(data, input.size(), messages.data(), messages.size());
+            assert(result.status == DECODE_END_OF_INPUT && result.consumed == input.size());
+            messages.resize(result.count);
+            assert(messages == expected);
+            assert(decoder.skipped == all.size() - expected.size());
+        };
+
+        midi_filter_t no_sysex;
+        no_sysex.kinds &= ~kind_mask(STATUS_SYSEX);
+        check(no_sysex, [](const midi_message_t &m) { return m.status != 0xf0u; });
+
+        midi_filter_t only_sysex{0, kind_mask(STATUS_SYSEX)};
+        check(only_sysex, [](const midi_message_t &m) { return m.status == 0xf0u; });
+
+        // compile-time filter
+        check([](uint8_t status, uint8_t data1) { return status == 0xf0u && data1 == 0x43; },
+              [](const midi_message_t &m) {
+                  return m.status == 0xf0u && std::get<sysex_message_t>(std::get<system_message_t>(m.message)).id == 0x43;
+              });
+
+        // channel 2 notes and volume changes only, with running status
+        midi_filter_t channel{channel_mask(2), kind_mask(STATUS_NOTE_ON) | kind_mask(STATUS_CONTROL_CHANGE)};
+        channel.set_controllers({CHANNEL_VOLUME_FORMERLY_MAIN_VOLUME_MSB});
+        const uint8_t stream[] = {0x91, 0x3c, 0x40, 0x3e, 0x40, 0x92, 0x3c, 0x40, 0xf8, 0x3e, 0x40,
+                                  0xf0, 0x43, 0x10, 0xf8, 0x4c, 0xf7, 0xb2, 0x01, 0x10, 0x07, 0x64, 0xb3, 0x07, 0x64};
+        filtered_decoder decoder(channel);
+        midi_message_t message(0xf0, system_message_t{sysex_message_t(0x7d, "unchanged")});
+        const auto previous = message;
+        size_t length;
+        std::vector<uint8_t> realtime;
+        auto collect = [&realtime](uint8_t c) { realtime.push_back(c); };
+        assert(decoder.try_decode(stream, sizeof(stream), message, length, collect) == DECODE_OK);
+        assert(length == 8 && message == midi_message_t(0x92, note_on_t(0x3c, 0x40)));
+        assert(decoder.try_decode(stream + 8, sizeof(stream) - 8, message, length, collect) == DECODE_OK);
+        assert(length == 3 && message == midi_message_t(0x92, note_on_t(0x3e, 0x40)));
+        // skipped: real-time, sysex (its real-time byte is still reported), bank select
+        assert(decoder.try_decode(stream + 11, sizeof(stream) - 11, message, length, collect) == DECODE_OK);
+        assert(length == 11 && message == midi_message_t(0xb2, control_change_t(CHANNEL_VOLUME_FORMERLY_MAIN_VOLUME_MSB, 0x64)));
+        assert(realtime == std::vector<uint8_t>{0xf8});
+        assert(decoder.try_decode(stream + 22, sizeof(stream) - 22, message, length, collect) == DECODE_END_OF_INPUT);
+        assert(length == 3 && decoder.skipped == 6);
+
+        filtered_decoder none([](uint8_t, uint8_t) { return false; });
+        message = previous;
+        assert(none.try_decode(stream, sizeof(stream), message, length) == DECODE_END_OF_INPUT);
+        assert(length == sizeof(stream) && message == previous);
+    }
+    TEST("Channel Demultiplexer");
+    {
+        // one queue per channel, consumed by a worker thread each
+        using queue_t = spsc_ring_buffer<midi_event_t, 64>;
+        auto queues = std::make_unique<queue_t[]>(DEMUX_SYSTEM + 1);
+        channel_demux<queue_t> demux;
+        for (size_t i = 0; i <= DEMUX_SYSTEM; ++i) {
+            if (i != 5) demux.connect(i, &queues[i]);
+        }
+
+        std::vector<midi_event_t> events;
+        for (unsigned i = 0; i < 200; ++i) {
+            const auto type = i % 11 == 0 ? unsigned(SYSTEMMESSAGE) : unsigned(NOTEOFF + i % 7);
+            events.push_back(midi_event_t{uint8_t(make_status_byte(type, i % 16)), uint8_t(i % 128)});
+        }
+
+        std::atomic<bool> done{false};
+        std::vector<std::vector<midi_event_t>> received(DEMUX_SYSTEM + 1);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i <= DEMUX_SYSTEM; ++i) {
+            workers.emplace_back([&, i]() {
+                midi_event_t event;
+                for (;;) {
+                    const auto finished = done.load();
+                    while (queues[i].try_pop(event)) received[i].push_back(event);
+                    if (finished) break;
+                    std::this_thread::yield();
+                }
+            });
+        }
+        size_t missing = 0;
+        for (const auto &event : events) {
+            if (event.status < 0xf0u && status_get_channel(event.status) == 5) {
+                ++missing;
+                assert(!demux.route(event));
+                continue;
+            }
+            while (!demux.route(event)) --demux.dropped;
+        }
+        done = true;
+        for (auto &worker : workers) worker.join();
+        assert(demux.dropped == missing);
+
+        for (size_t i = 0; i <= DEMUX_SYSTEM; ++i) {
+            std::vector<midi_event_t> expected;
+            std::copy_if(events.begin(), events.end(), std::back_inserter(expected), [i](const midi_event_t &e) {
+                return e.status >= 0xf0u ? i == DEMUX_SYSTEM : status_get_channel(e.status) == i && i != 5;
+            });
+            assert(received[i] == expected);
+        }
+
+        // handler objects and decoded messages
+        struct counter {
+            size_t count{0};
+
+            void operator()(const midi_message_t &) {
+                ++count;
+            }
+        };
+        counter channels[2];
+        channel_demux<counter> handlers;
+        handlers.connect(9, &channels[0]);
+        handlers.connect(DEMUX_SYSTEM, &channels[1]);
+        handlers.route(midi_message_t(make_status_byte(NOTEON, 9), note_on_t(36u, 100u)));
+        handlers.route(midi_message_t(make_status_byte(SYSTEMMESSAGE, TIMING_CLOCK), system_message_t{uint8_t{0}}));
+        handlers.route(midi_message_t(make_status_byte(NOTEON, 0), note_on_t(60u, 100u)));
+        assert(channels[0].count == 1 && channels[1].count == 1 && handlers.dropped == 1);
+    }
+    TEST("Controller Bank");
+    {
+        struct change_counter {
+            size_t *changes;
+
+            void operator()(uint8_t channel, controller_t, uint16_t) const {
+                ++changes[channel];
+            }
+        };
+        size_t changes[16]{};
+        controller_bank<change_counter> bank(change_counter{changes});
+        controller_state_test states[16];
+
+        std::vector<midi_event_t> events;
+        uint32_t seed = 7;
+        for (unsigned i = 0; i < 2000; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            const auto type = (seed >> 24) % 8 ? CONTROLCHANGE : NOTEON;
+            events.push_back(midi_event_t{uint8_t(make_status_byte(type, seed >> 8)), uint8_t((seed >> 12) & 127u),
+                                          uint8_t((seed >> 20) & 127u)});
+        }
+        bank.apply(events.begin(), events.end());
+
+        size_t expected[16]{};
+        for (const auto &event : events) {
+            if (status_get_type(event.status) != CONTROLCHANGE) continue;
+            const auto channel = status_get_channel(event.status);
+            if (states[channel].apply(event.data1, event.data2)) ++expected[channel];
+        }
+        for (uint8_t channel = 0; channel < 16; ++channel) {
+            assert(changes[channel] == expected[channel]);
+            for (uint8_t controller = 0; controller < 128; ++controller) {
+                assert(bank.get(channel, controller) == states[channel].get(controller));
+            }
+        }
+
+        controller_bank<> plain;
+        static_assert(sizeof(plain.states) == 16 * 128 * sizeof(uint16_t));
+        plain.apply(3, BANK_SELECT_MSB, 1);
+        plain.apply(3, BANK_SELECT_LSB, 2);
+        assert(plain.get(3, BANK_SELECT_MSB) == 0x0102 && plain.get(3, BANK_SELECT_LSB) == 0x0102);
+        assert(plain.get(2, BANK_SELECT_MSB) == 0);
+        plain.reset();
+        assert(plain.get(3, BANK_SELECT_MSB) == 0);
+    }
+    TEST("Controller Dirty Mask");
+    {
+        controller_state state;
+        assert(!state.apply(CHANNEL_VOLUME_FORMERLY_MAIN_VOLUME_MSB, 0));
+        assert(!state.dirty.any());
+
+        // a fader sweep: many messages, one update per block
+        for (uint8_t v = 0; v < 128; ++v) state.apply(CHANNEL_VOLUME_FORMERLY_MAIN_VOLUME_MSB, v);
+        assert(state.apply(CHANNEL_VOLUME_FORMERLY_MAIN_VOLUME_LSB, 5));
+        assert(state.apply(DAMPER_PEDAL_ON_OFF_SUSTAIN, 127));
+        assert(!state.apply(DAMPER_PEDAL_ON_OFF_SUSTAIN, 100));
+        assert(state.apply(POLY_MODE_ON_OFF_ALL_NOTES_OFF, 1));
+        std::vector<std::pair<controller_t, uint16_t>> updates;
+        state.drain([&updates](controller_t controller, uint16_t value) { updates.emplace_back(controller, value); });
+        assert((updates == std::vector<std::pair<controller_t, uint16_t>>{
+                {CHANNEL_VOLUME_FORMERLY_MAIN_VOLUME_MSB, 0x7f05}, {DAMPER_PEDAL_ON_OFF_SUSTAIN, 1},
+                {POLY_MODE_ON_OFF_ALL_NOTES_OFF, 1}}));
+        assert(!state.dirty.any());
+        updates.clear();
+        state.drain([&updates](controller_t controller, uint16_t value) { updates.emplace_back(controller, value); });
+        assert(updates.empty());
+
+        controller_bank<> bank;
+        const midi_event_t events[] = {{make_status_byte(CONTROLCHANGE, 2), MODULATION_WHEEL_MSB, 10},
+                                       {make_status_byte(CONTROLCHANGE, 2), MODULATION_WHEEL_MSB, 11},
+                                       {make_status_byte(NOTEON, 2), 60, 64},
+                                       {make_status_byte(CONTROLCHANGE, 9), PAN_MSB, 0},
+                                       {make_status_byte(CONTROLCHANGE, 9), EXPRESSION_CONTROLLER_MSB, 90}};
+        bank.apply(std::begin(events), std::end(events));
+        assert(bank.dirty[2].test(MODULATION_WHEEL_MSB) && !bank.dirty[9].test(PAN_MSB));
+        updates.clear();
+        bank.drain(2, [&updates](controller_t controller, uint16_t value) { updates.emplace_back(controller, value); });
+        assert((updates == std::vector<std::pair<controller_t, uint16_t>>{{MODULATION_WHEEL_MSB, 11 << 8}}));
+        assert(!bank.dirty[2].any() && bank.dirty[9].any());
+    }
+    TEST("Parameter Numbers");
+    {
+        std::vector<parameter_event_t> events;
+        auto decoder = make_parameter_decoder([&events](const parameter_event_t &event) { events.push_back(event); });
+        auto cc = [](uint8_t channel, uint8_t controller, uint8_t value) {
+            return midi_event_t{uint8_t(make_status_byte(CONTROLCHANGE, channel)), controller, value};
+        };
+        const midi_event_t stream[] = {
+                // data entry without a parameter is ignored
+                cc(0, DATA_ENTRY_MSB, 5),
+                // pitch bend sensitivity: 12 semitones, 50 cents
+                cc(0, REGISTERED_PARAMETER_NUMBER_MSB, 0), cc(0, REGISTERED_PARAMETER_NUMBER_LSB, 0),
+                cc(0, DATA_ENTRY_MSB, 12), cc(0, DATA_ENTRY_LSB, 50),
+                cc(0, DATA_ENTRY_PLUS_1, 0), cc(0, DATA_ENTRY_MINUS_1, 0), cc(0, DATA_ENTRY_MINUS_1, 0),
+                // other messages and channels in between
+                midi_event_t{make_status_byte(NOTEON, 0), 60, 64}, cc(0, CHANNEL_VOLUME_FORMERLY_MAIN_VOLUME_MSB, 100),
+                cc(3, NON_REGISTERED_PARAMETER_NUMBER_MSB, 1), cc(3, NON_REGISTERED_PARAMETER_NUMBER_LSB, 8),
+                cc(0, DATA_ENTRY_MSB, 2),
+                cc(3, DATA_ENTRY_MSB, 64), cc(3, DATA_ENTRY_MINUS_1, 0),
+                // null RPN
+                cc(0, REGISTERED_PARAMETER_NUMBER_MSB, 127), cc(0, REGISTERED_PARAMETER_NUMBER_LSB, 127),
+                cc(0, DATA_ENTRY_MSB, 1), cc(0, DATA_ENTRY_PLUS_1, 0),
+        };
+        decoder.apply(std::begin(stream), std::end(stream));
+        assert((events == std::vector<parameter_event_t>{
+                {0, true, 0, 12 << 7}, {0, true, 0, 12 << 7 | 50}, {0, true, 0, 12 << 7 | 51, 1},
+                {0, true, 0, 12 << 7 | 50, -1}, {0, true, 0, 12 << 7 | 49, -1},
+                {0, true, 0, 2 << 7},
+                {3, false, 1 << 7 | 8, 64 << 7}, {3, false, 1 << 7 | 8, (64 << 7) - 1, -1}}));
+
+        assert(decoder.apply(0, DATA_ENTRY_LSB, 1));
+        assert(!decoder.apply(0, MODULATION_WHEEL_MSB, 1));
+        decoder.reset();
+        events.clear();
+        decoder.apply(3, DATA_ENTRY_MSB, 1);
+        assert(events.empty());
+
+        // select, then increment without data entry: the value is not known, only the step
+        const midi_event_t steps[] = {
+                cc(1, REGISTERED_PARAMETER_NUMBER_MSB, 0), cc(1, REGISTERED_PARAMETER_NUMBER_LSB, 2),
+                cc(1, DATA_ENTRY_PLUS_1, 0),
+                // reselecting the same parameter keeps its value
+                cc(1, DATA_ENTRY_MSB, 64), cc(1, REGISTERED_PARAMETER_NUMBER_MSB, 0),
+                cc(1, REGISTERED_PARAMETER_NUMBER_LSB, 2), cc(1, DATA_ENTRY_PLUS_1, 0),
+                // another parameter starts without a value
+                cc(1, REGISTERED_PARAMETER_NUMBER_LSB, 1), cc(1, DATA_ENTRY_MINUS_1, 0),
+                // no change at the limits, no event
+                cc(1, DATA_ENTRY_MSB, 0), cc(1, DATA_ENTRY_MINUS_1, 0),
+                cc(1, DATA_ENTRY_MSB, 127), cc(1, DATA_ENTRY_LSB, 127), cc(1, DATA_ENTRY_PLUS_1, 0),
+        };
+        decoder.apply(std::begin(steps), std::end(steps));
+        assert((events == std::vector<parameter_event_t>{
+                {1, true, 2, UNKNOWN_PARAMETER_VALUE, 1}, {1, true, 2, 64 << 7}, {1, true, 2, 64 << 7 | 1, 1},
+                {1, true, 1, UNKNOWN_PARAMETER_VALUE, -1}, {1, true, 1, 0},
+                {1, true, 1, 127 << 7}, {1, true, 1, 0x3fff}}));
+    }
+    TEST("Note Tracker");
+    {
+        note_tracker notes;
+        auto keys = [&notes](uint8_t channel) {
+            std::vector<uint8_t> result;
+            notes.sounding(channel).for_each([&result](uint8_t key) { result.push_back(key); });
+            return result;
+        };
+
+        notes.apply(make_status_byte(NOTEON, 0), 60, 100);
+        notes.apply(make_status_byte(NOTEON, 0), 64, 100);
+        notes.apply(make_status_byte(NOTEON, 0), 127, 100);
+        notes.apply(make_status_byte(NOTEON, 0), 64, 100);
+        notes.apply(make_status_byte(NOTEON, 1), 36, 100);
+        assert(notes.polyphony == 4 && notes.channel_polyphony(0) == 3);
+        // velocity 0 is a note-off
+        notes.apply(make_status_byte(NOTEON, 0), 60, 0);
+        notes.apply(make_status_byte(NOTEOFF, 1), 36, 64);
+        assert(notes.polyphony == 2 && (keys(0) == std::vector<uint8_t>{64, 127}) && keys(1).empty());
+
+        // sustain keeps released keys sounding until the pedal is released
+        notes.control_change(0, DAMPER_PEDAL_ON_OFF_SUSTAIN, 127);
+        notes.note_on(0, 60, 90);
+        notes.note_off(0, 60);
+        notes.note_off(0, 64);
+        assert(notes.channel_polyphony(0) == 3 && (keys(0) == std::vector<uint8_t>{60, 64, 127}));
+        // ALL_NOTES_OFF releases held keys, which the pedal sustains
+        notes.control_change(0, ALL_NOTES_OFF, 0);
+        assert(notes.channel_polyphony(0) == 3);
+        notes.note_on(0, 62, 90);
+        notes.control_change(0, DAMPER_PEDAL_ON_OFF_SUSTAIN, 0);
+        assert(notes.polyphony == 1 && (keys(0) == std::vector<uint8_t>{62}));
+        notes.control_change(0, ALL_NOTES_OFF, 0);
+        assert(notes.polyphony == 0 && keys(0).empty());
+
+        notes.note_on(2, 40, 1);
+        notes.control_change(2, DAMPER_PEDAL_ON_OFF_SUSTAIN, 100);
+        notes.note_off(2, 40);
+        notes.control_change(2, ALL_SOUND_OFF, 0);
+        assert(notes.polyphony == 0 && keys(2).empty());
+
+        // panic: pedal release for sustained keys, note-off for held keys only
+        notes.note_on(3, 50, 1);
+        notes.note_on(3, 51, 1);
+        notes.control_change(3, DAMPER_PEDAL_ON_OFF_SUSTAIN, 127);
+        notes.note_off(3, 50);
+        notes.note_on(15, 0, 1);
+        std::vector<midi_event_t> panic;
+        notes.panic([&panic](const midi_event_t &event) { panic.push_back(event); });
+        assert((panic == std::vector<midi_event_t>{{make_status_byte(CONTROLCHANGE, 3), DAMPER_PEDAL_ON_OFF_SUSTAIN, 0},
+                                                   {make_status_byte(NOTEOFF, 3), 51, 0},
+                                                   {make_status_byte(NOTEOFF, 15), 0, 0}}));
+        assert(notes.polyphony == 0);
+
+        // replaying the panic messages on a copy silences it, too
+        note_tracker copy;
+        copy.note_on(3, 50, 1);
+        copy.note_on(3, 51, 1);
+        copy.control_change(3, DAMPER_PEDAL_ON_OFF_SUSTAIN, 127);
+        copy.note_off(3, 50);
+        copy.note_on(15, 0, 1);
+        copy.apply(panic.begin(), panic.end());
+        assert(copy.polyphony == 0);
+    }
+    TEST("Note Spans");
+    {
+        mapped_file file("fixtures/test7.mid");
+        smf_file smf(file);
+        const auto tracks = decode_smf_tracks(smf);
+        note_span_extractor extractor;
+        extractor.apply(tracks[1].events.begin(), tracks[1].events.end());
+        extractor.finish(1000);
+        const auto &spans = extractor.spans;
+        // the note-on with velocity 0 ends the first note, the note-off the second
+        assert(spans.size() == 2 && extractor.unmatched == 0);
+        assert((spans.start == std::vector<uint64_t>{0, 48}) && (spans.end == std::vector<uint64_t>{96, 296}));
+        assert((spans.key == std::vector<uint8_t>{60, 64}) && (spans.velocity == std::vector<uint8_t>{64, 64}));
+        assert((spans.channel == std::vector<uint8_t>{0, 0}));
+
+        // overlapping notes of the same key
+        for (auto policy : {NOTE_OVERLAP_FIFO, NOTE_OVERLAP_LIFO}) {
+            note_span_extractor overlap(policy);
+            overlap.note_on(0, 1, 60, 10);
+            overlap.note_on(10, 1, 60, 20);
+            overlap.note_on(15, 2, 60, 30);
+            overlap.note_on(20, 1, 60, 40);
+            overlap.note_off(30, 1, 60);
+            overlap.note_on(40, 1, 60, 0);
+            overlap.note_off(50, 1, 60);
+            overlap.note_off(60, 1, 60);
+            overlap.note_off(70, 1, 61);
+            overlap.finish(100);
+            assert(overlap.unmatched == 2);
+            assert((overlap.spans.velocity == std::vector<uint8_t>{10, 20, 30, 40}));
+            if (policy == NOTE_OVERLAP_FIFO) {
+                assert((overlap.spans.end == std::vector<uint64_t>{30, 40, 100, 50}));
+            } else {
+                assert((overlap.spans.end == std::vector<uint64_t>{50, 40, 100, 30}));
+            }
+        }
+    }
     return 0;
 }
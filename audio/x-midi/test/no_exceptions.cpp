@@ -0,0 +1,66 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// compiled with -fno-exceptions
+#include <format-commons/audio/x-midi/decoder.hpp>
+
+#include <cstdio>
+#include <vector>
+#include <cassert>
+
+using namespace format::audio::x_midi;
+
+#define TEST(x) fprintf(stderr, "Test %2i: %s\n", tc++, x)
+
+std::vector<uint8_t> get_file(const char *name) {
+    std::vector<uint8_t> out;
+    auto path = std::string("fixtures/") + name + ".syx";
+    auto f = fopen(path.c_str(), "rb");
+    assert(f);
+    for (int c = fgetc(f); c != EOF; c = fgetc(f)) {
+        out.push_back(c);
+    }
+    fclose(f);
+    return out;
+}
+
+int main() {
+    int tc = 1;
+
+    TEST("Decode Status (recorded)");
+    {
+        const auto input = get_file("test4");
+        midi_message_t message;
+        size_t length = 0, offset = 0;
+        size_t count = 0;
+        decode_status status;
+        while ((status = try_decode_midi_message(input.data() + offset, input.size() - offset, message, length)) == DECODE_OK) {
+            offset += length;
+            ++count;
+        }
+        assert(status == DECODE_END_OF_INPUT);
+        assert(count == 7 && offset == input.size());
+        assert(message == midi_message_t(make_status_byte(CONTROLCHANGE, 0), control_change_t(93u, 25u)));
+
+        assert(try_decode_midi_message(input.data(), 2, message, length) == DECODE_NEED_MORE_DATA);
+        assert(try_decode_midi_message(input.data() + 1, input.size() - 1, message, length) == DECODE_INVALID_STATUS);
+
+        const uint8_t empty_sysex[] = {0xf0, 0xf7};
+        assert(try_decode_midi_message(empty_sysex, sizeof(empty_sysex), message, length) == DECODE_EMPTY_SYSEX);
+        assert(try_decode_midi_message(empty_sysex, 1, message, length) == DECODE_NEED_MORE_DATA);
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2020 Fabian Stiewitz <fabian@stiewitz.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// compiled with the default, portable (FORMAT_COMMONS_AUDIO_X_MIDI_NO_SIMD) and AVX2 (-mavx2) scanners
+#include <format-commons/audio/x-midi/scan.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include <cassert>
+
+using namespace format::audio::x_midi;
+
+#define TEST(x) fprintf(stderr, "Test %2i: %s\n", tc++, x)
+
+#if defined(FORMAT_COMMONS_AUDIO_X_MIDI_NO_SIMD)
+static_assert(scan_block_size == 8);
+#elif defined(__AVX2__)
+static_assert(scan_block_size == 32);
+#endif
+
+int main() {
+    int tc = 1;
+
+    TEST("Scanner");
+    {
+        std::vector<uint8_t> buffer(1000);
+        uint32_t seed = 1;
+        for (auto &c : buffer) {
+            seed = seed * 1103515245u + 12345u;
+            // mostly data bytes
+            c = (seed >> 16) % 20 == 0 ? 0x80u | (seed >> 8) : (seed >> 8) & 127u;
+        }
+        for (size_t begin = 0; begin < 70; ++begin) {
+            for (size_t end = begin; end < buffer.size(); end += 1 + end % 13) {
+                const auto b = buffer.data() + begin, e = buffer.data() + end;
+                assert(find_status_byte(b, e) == std::find_if(b, e, [](uint8_t c) { return c & 128u; }));
+                assert(find_sysex_end(b, e) == std::find(b, e, 0b11110111));
+                std::vector<const uint8_t *> positions;
+                for_each_status_byte(b, e, [&positions](const uint8_t *at) { positions.push_back(at); });
+                std::vector<const uint8_t *> expected;
+                for (auto it = b; it != e; ++it) if (*it & 128u) expected.push_back(it);
+                assert(positions == expected);
+            }
+        }
+
+        // the same in chunks of any size
+        const uint8_t stream[] = {0x90, 0x3c, 0x40, 0xf0, 0x43, 0xf8, 0x10, 0xf7, 0x3c, 0x00, 0xfe, 0xf0, 0x7d, 0x01,
+                                  0xb0, 0x40, 0x7f, 0xf0, 0x7d};
+        for (size_t chunk = 1; chunk <= sizeof(stream); ++chunk) {
+            midi_scanner scanner;
+            for (size_t i = 0; i < sizeof(stream); i += chunk) {
+                scanner.scan(stream + i, std::min(chunk, sizeof(stream) - i));
+            }
+            assert((scanner.boundaries == std::vector<size_t>{0, 3, 11, 14, 17}));
+            assert((scanner.realtime == std::vector<size_t>{5, 10}));
+            assert((scanner.sysex == std::vector<sysex_extent_t>{{3, 8, true}, {11, 14, false}}));
+            assert(scanner.in_sysex && scanner.sysex_begin == 17);
+        }
+    }
+    return 0;
+}